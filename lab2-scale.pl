@@ -0,0 +1,90 @@
+#! /usr/bin/perl -w
+
+# Scaling benchmark for the osprd request path.
+#
+# Reads a device with 1, 2, ... up to --cpus concurrent workers, each pinned
+# to its own CPU, and prints the combined throughput and the speedup over
+# one worker.  Workers read the whole device over and over with direct I/O
+# for --seconds, so the page cache stays out of the way and every read goes
+# through the driver.  --write writes zeros instead, destroying the
+# device's contents.
+#
+# Run it once with the module loaded normally and once with "mq=1" to see
+# how far each request path scales.  Give the devices enough sectors that a
+# pass is not dominated by starting dd, e.g. "insmod osprd.ko nsectors=8192".
+#
+# Usage: ./lab2-scale.pl [--device=/dev/osprda] [--cpus=N] [--seconds=S]
+#            [--bs=BYTES] [--write]
+
+use strict;
+use Getopt::Long;
+use Time::HiRes qw(time);
+
+my(%opt) = (
+    'device' => '/dev/osprda',
+    'cpus' => 0,		# default: every online CPU
+    'seconds' => 3,		# how long each run lasts
+    'bs' => 4096,		# bytes per read or write
+    'write' => 0,
+    );
+GetOptions(\%opt, 'device=s', 'cpus=i', 'seconds=f', 'bs=i', 'write')
+    || die "Usage: $0 [--OPTION=VALUE]... (see the top of $0)\n";
+if (!$opt{'cpus'}) {
+    open(CPUINFO, "/proc/cpuinfo") || die "/proc/cpuinfo: $!\n";
+    $opt{'cpus'} = grep { /^processor\s*:/ } <CPUINFO>;
+    close(CPUINFO);
+}
+
+my($dd) = $opt{'write'}
+    ? "dd if=/dev/zero of=$opt{'device'} bs=$opt{'bs'} oflag=direct conv=notrunc"
+    : "dd if=$opt{'device'} of=/dev/null bs=$opt{'bs'} iflag=direct";
+
+# Transfer as much as possible on CPU $cpu until $deadline, then report the
+# number of bytes moved.
+sub worker ($$$) {
+    my($cpu, $out, $deadline) = @_;
+    system("taskset -pc $cpu $$ >/dev/null") == 0
+	|| die "taskset: can't pin worker to CPU $cpu\n";
+    my($bytes) = 0;
+    while (time < $deadline) {
+	my($result) = scalar(`$dd 2>&1`);
+	$result =~ /^(\d+) bytes/m || die "dd failed: $result";
+	$bytes += $1;
+    }
+    syswrite($out, "$bytes\n");
+    exit(0);
+}
+
+# Run $n workers at once.  Returns the combined throughput in MB/s.
+sub run ($) {
+    my($n) = @_;
+    pipe(RESULTS, OUT) || die "pipe: $!\n";
+    my($begin) = time;
+    my($deadline) = $begin + $opt{'seconds'};
+    for (my $cpu = 0; $cpu < $n; $cpu++) {
+	my($pid) = fork;
+	die "fork: $!\n" if !defined($pid);
+	if ($pid == 0) {
+	    close(RESULTS);
+	    worker($cpu, \*OUT, $deadline);
+	}
+    }
+    close(OUT);
+
+    my($bytes) = 0;
+    $bytes += $_ foreach <RESULTS>;
+    close(RESULTS);
+    while (wait > 0) {
+	die "a worker failed\n" if $? != 0;
+    }
+    return $bytes / (time - $begin) / 1e6;
+}
+
+printf("%-6s %10s %8s\n", "cpus", "MB/s", "speedup");
+my($base);
+for (my $n = 1; $n <= $opt{'cpus'}; $n++) {
+    my($rate) = run($n);
+    $base = $rate if $n == 1;
+    printf("%-6d %10.1f %8.2f\n", $n, $rate, $base ? $rate / $base : 0);
+}
+exit(0);
@@ -0,0 +1,518 @@
+#! /usr/bin/perl -w
+
+# Concurrency and fairness stress test for the osprd lock.
+#
+# Launches hundreds of concurrent lockers against one device: blocking
+# readers and writers, trylockers, and "abandoners" that are killed by a
+# signal while they may still be waiting for the lock.  Every locker reports
+# when it asked for the lock, when it got it, and when it let it go.  The
+# run FAILS if
+#   - a write lock overlapped any other lock,
+#   - a blocking locker was granted before one that queued well before it,
+#   - a locker starved (waited longer than --max-wait),
+#   - the 99th percentile acquire latency exceeded --p99, or
+#   - throughput fell below --min-rate lock acquisitions per second.
+# The ordering check only applies to the strict FIFO policy.
+#
+# --policy=NAME first switches the device to lock scheduling policy NAME
+# (fifo, readers, writers or phasefair), which needs root.  The default,
+# fifo, is the device's own default and is left alone.  --bench instead
+# runs the same load under every policy and prints a table of throughput
+# and reader and writer latency, without checking thresholds; run as
+# another user, it covers fifo only.
+#
+# --handoff measures how fast the lock passes between processes under heavy
+# contention instead: --writers processes each take and drop the write lock
+# --rounds times, holding it for no time at all, and the delay from each
+# release to the next grant is reported.  It FAILS only if two write locks
+# overlapped.
+#
+# --seqread checks lockless reads, and needs the module loaded with
+# "seqread=1": --writers processes keep overwriting the device's first
+# 4096 bytes with one repeated byte, without the lock, while --readers
+# processes read them --rounds times each with "osprdaccess -S".  It FAILS
+# if a read saw bytes from two different writes.  "make seqread" runs it
+# with a few processes.
+#
+# --checksum checks sector checksums, and needs the module loaded with
+# "checksum=1": the same writers race with --readers processes that read
+# the first page --rounds times each with "osprdaccess -V", which bypasses
+# the page cache.  It FAILS if a read failed, if /proc/osprd counts a
+# checksum error, or if the scrubber checked no sectors meanwhile.
+# "make checksum" runs it with a few processes.
+#
+# Usage: ./lab2-stress.pl [--device=/dev/osprda] [--readers=N] [--writers=N]
+#            [--trylockers=N] [--abandoners=N] [--hold=MS] [--spread=MS]
+#            [--p99=MS] [--max-wait=MS] [--min-rate=N] [--fifo-slack=MS]
+#            [--seed=N] [--policy=NAME | --bench | --handoff [--rounds=N]
+#             | --seqread [--rounds=N] | --checksum [--rounds=N]]
+
+use strict;
+use Getopt::Long;
+use Fcntl;
+use POSIX qw(:sys_wait_h);
+use Time::HiRes qw(time sleep alarm);
+
+# ioctl constants from osprd.h
+my($OSPRDIOCACQUIRE) = 42;
+my($OSPRDIOCTRYACQUIRE) = 43;
+my($OSPRDIOCRELEASE) = 44;
+my($OSPRDIOCSETPOLICY) = 45;
+my(%policies) = ('fifo' => 0, 'readers' => 1, 'writers' => 2, 'phasefair' => 3);
+
+my(%opt) = (
+    'device' => '/dev/osprda',
+    'readers' => 200,		# blocking read lockers
+    'writers' => 50,		# blocking write lockers
+    'trylockers' => 50,		# half read, half write
+    'abandoners' => 20,		# blocking lockers killed by SIGALRM
+    'hold' => 20,		# max time a lock is held, ms
+    'spread' => 2000,		# lockers start within this many ms
+    'p99' => 1500,		# max 99th percentile acquire latency, ms
+    'max-wait' => 5000,		# max acquire latency for anyone, ms
+    'min-rate' => 20,		# min lock acquisitions per second
+    'fifo-slack' => 20,		# ignore queueing order closer than this, ms
+    'seed' => time,
+    'policy' => 'fifo',
+    'bench' => 0,
+    'handoff' => 0,
+    'rounds' => 200,		# lock acquisitions per --handoff writer,
+				# or reads per --seqread or --checksum
+				# reader
+    'seqread' => 0,
+    'checksum' => 0,
+    );
+GetOptions(\%opt, 'device=s', 'readers=i', 'writers=i', 'trylockers=i',
+	   'abandoners=i', 'hold=f', 'spread=f', 'p99=f', 'max-wait=f',
+	   'min-rate=f', 'fifo-slack=f', 'seed=i', 'policy=s', 'bench',
+	   'handoff', 'rounds=i', 'seqread', 'checksum')
+    && exists($policies{$opt{'policy'}})
+    || die "Usage: $0 [--OPTION=VALUE]... (see the top of $0)\n";
+srand($opt{'seed'});
+
+# Run one locker.  Reports "KIND ASKED GOT RELEASED" in seconds, or
+# "KIND ASKED busy" for a trylocker that could not get the lock.
+sub locker ($$$) {
+    my($kind, $out, $start) = @_;
+    my($writable) = ($kind =~ /^[wW]/);
+    my($try) = ($kind =~ /^[RW]$/);
+    sleep($start);
+
+    sysopen(DEV, $opt{'device'}, $writable ? O_WRONLY : O_RDONLY)
+	|| die "$opt{'device'}: $!\n";
+    if ($kind =~ /a$/) {
+	# Abandoner: die by signal if the lock takes too long
+	$SIG{'ALRM'} = 'DEFAULT';
+	alarm(0.05 + rand(0.5));
+    }
+
+    my($asked) = time;
+    if (!ioctl(DEV, $try ? $OSPRDIOCTRYACQUIRE : $OSPRDIOCACQUIRE, 0)) {
+	if ($try && $!{EBUSY}) {
+	    syswrite($out, sprintf("%s %.6f busy\n", $kind, $asked));
+	    exit(0);
+	}
+	die "$kind ioctl: $!\n";
+    }
+    my($got) = time;
+    alarm(0);
+    sleep(rand($opt{'hold'}) / 1000);
+    my($released) = time;
+    ioctl(DEV, $OSPRDIOCRELEASE, 0) || die "$kind release: $!\n";
+    syswrite($out, sprintf("%s %.6f %.6f %.6f\n", $kind, $asked, $got, $released));
+    exit(0);
+}
+
+# Switch the device to lock scheduling policy $name.  Switching needs root,
+# so unless $force is set, fifo, the default, is assumed to be in effect
+# already.
+sub set_policy ($;$) {
+    my($name, $force) = @_;
+    return if $name eq 'fifo' && !$force;
+    sysopen(POLICY, $opt{'device'}, O_RDONLY) || die "$opt{'device'}: $!\n";
+    ioctl(POLICY, $OSPRDIOCSETPOLICY, $policies{$name})
+	|| die "ioctl OSPRDIOCSETPOLICY: $!\n";
+    close(POLICY);
+}
+
+# Return the $frac quantile of a sorted list, in ms.
+sub quantile ($@) {
+    my($frac, @sorted) = @_;
+    return 0 if !@sorted;
+    return $sorted[int($#sorted * $frac)] * 1000;
+}
+
+# Run every locker once under the current policy and check the results.
+# Returns a hash of statistics; $stats{'failures'} lists what went wrong.
+sub run_stress () {
+    # Kinds: r/w block, R/W try, ra/wa block and may be killed while waiting.
+    my(@kinds) = (('r') x $opt{'readers'}, ('w') x $opt{'writers'},
+		  map { $_ % 2 ? 'R' : 'W' } (1 .. $opt{'trylockers'}));
+    push(@kinds, map { $_ % 2 ? 'ra' : 'wa' } (1 .. $opt{'abandoners'}));
+
+    pipe(RESULTS, OUT) || die "pipe: $!\n";
+    my($begin) = time;
+    my(%children);
+    foreach my $kind (@kinds) {
+	my($start) = rand($opt{'spread'}) / 1000;
+	my($pid) = fork;
+	die "fork: $!\n" if !defined($pid);
+	if ($pid == 0) {
+	    close(RESULTS);
+	    locker($kind, \*OUT, $start);
+	}
+	$children{$pid} = $kind;
+    }
+    close(OUT);
+
+    my(@lines) = <RESULTS>;
+    close(RESULTS);
+    my($errors, $killed) = (0, 0);
+    while ((my $pid = wait) > 0) {
+	if (WIFSIGNALED($?) && $children{$pid} =~ /a$/) {
+	    $killed++;
+	} elsif ($? != 0) {
+	    $errors++;
+	}
+    }
+    my($end) = time;
+
+    my(@held, @rwaits, @wwaits, $busy);
+    foreach (@lines) {
+	my($kind, $asked, $got, $released) = split;
+	if ($got eq 'busy') {
+	    $busy++;
+	    next;
+	}
+	push(@held, [$kind, $asked, $got, $released]);
+	if ($kind =~ /^r/) {
+	    push(@rwaits, $got - $asked);
+	} elsif ($kind =~ /^w/) {
+	    push(@wwaits, $got - $asked);
+	}
+    }
+    die "no locker ever got the lock\n" if !@held;
+
+    my(@failures);
+    push(@failures, "$errors lockers failed") if $errors;
+
+    # Mutual exclusion: a write lock overlaps nothing.  The measured hold
+    # times lie inside the real ones, so any overlap here is a real overlap.
+    my($overlaps) = 0;
+    foreach my $a (@held) {
+	next if $a->[0] !~ /^[wW]/;
+	foreach my $b (@held) {
+	    $overlaps++ if $a != $b && $a->[2] < $b->[3] && $b->[2] < $a->[3];
+	}
+    }
+    push(@failures, "$overlaps lock holds overlapped a write lock") if $overlaps;
+
+    # FIFO: a blocking locker that asked well before another got the lock
+    # first.
+    if ($opt{'policy'} eq 'fifo') {
+	my($slack) = $opt{'fifo-slack'} / 1000;
+	my(@blocking) = sort { $a->[1] <=> $b->[1] } grep { $_->[0] !~ /^[RW]$/ } @held;
+	my($reorders) = 0;
+	for (my $i = 0; $i < @blocking; $i++) {
+	    for (my $j = $i + 1; $j < @blocking; $j++) {
+		next if $blocking[$j]->[1] - $blocking[$i]->[1] < $slack;
+		$reorders++ if $blocking[$j]->[2] + $slack < $blocking[$i]->[2];
+	    }
+	}
+	push(@failures, "$reorders lockers were granted out of order") if $reorders;
+    }
+
+    # Latency and throughput
+    my(@waits) = sort { $a <=> $b } (@rwaits, @wwaits);
+    @rwaits = sort { $a <=> $b } @rwaits;
+    @wwaits = sort { $a <=> $b } @wwaits;
+    my(%stats) = ('lockers' => scalar(@kinds), 'granted' => scalar(@held),
+		  'busy' => $busy || 0, 'abandoned' => $killed,
+		  'p50' => quantile(0.50, @waits), 'p99' => quantile(0.99, @waits),
+		  'max' => quantile(1, @waits),
+		  'read p50' => quantile(0.50, @rwaits),
+		  'read p99' => quantile(0.99, @rwaits),
+		  'write p50' => quantile(0.50, @wwaits),
+		  'write p99' => quantile(0.99, @wwaits),
+		  'rate' => @held / ($end - $begin), 'time' => $end - $begin);
+    push(@failures, sprintf("p99 acquire latency %.1f ms > %.1f ms", $stats{'p99'}, $opt{'p99'}))
+	if $stats{'p99'} > $opt{'p99'};
+    push(@failures, sprintf("a locker starved for %.1f ms > %.1f ms", $stats{'max'}, $opt{'max-wait'}))
+	if $stats{'max'} > $opt{'max-wait'};
+    push(@failures, sprintf("throughput %.1f locks/s < %.1f locks/s", $stats{'rate'}, $opt{'min-rate'}))
+	if $stats{'rate'} < $opt{'min-rate'};
+    $stats{'failures'} = \@failures;
+    return %stats;
+}
+
+# Take and drop the write lock --rounds times as fast as possible.  Reports
+# "GOT RELEASED" in seconds for each round, RELEASED being taken just
+# before the release.
+sub handoff_locker ($) {
+    my($out) = @_;
+    my(@lines);
+    sysopen(DEV, $opt{'device'}, O_WRONLY) || die "$opt{'device'}: $!\n";
+    for (my $i = 0; $i < $opt{'rounds'}; $i++) {
+	ioctl(DEV, $OSPRDIOCACQUIRE, 0) || die "handoff ioctl: $!\n";
+	my($got) = time;
+	my($released) = time;
+	ioctl(DEV, $OSPRDIOCRELEASE, 0) || die "handoff release: $!\n";
+	push(@lines, sprintf("%.6f %.6f\n", $got, $released));
+    }
+    syswrite($out, join('', @lines));
+    exit(0);
+}
+
+# Run the handoff benchmark and print its results.  Returns the number of
+# overlapping write locks.
+sub run_handoff () {
+    pipe(RESULTS, OUT) || die "pipe: $!\n";
+    my($begin) = time;
+    for (my $i = 0; $i < $opt{'writers'}; $i++) {
+	my($pid) = fork;
+	die "fork: $!\n" if !defined($pid);
+	if ($pid == 0) {
+	    close(RESULTS);
+	    handoff_locker(\*OUT);
+	}
+    }
+    close(OUT);
+    my(@held) = sort { $a->[0] <=> $b->[0] } map { [split] } <RESULTS>;
+    close(RESULTS);
+    while (wait > 0) {
+	die "a handoff locker failed\n" if $? != 0;
+    }
+    my($end) = time;
+
+    # Each grant follows the release before it
+    my(@gaps, $overlaps);
+    for (my $i = 1; $i < @held; $i++) {
+	my($gap) = $held[$i]->[0] - $held[$i - 1]->[1];
+	if ($gap < 0) {
+	    $overlaps++;
+	} else {
+	    push(@gaps, $gap);
+	}
+    }
+    @gaps = sort { $a <=> $b } @gaps;
+    printf("%d writers x %d rounds (policy %s): %.1f locks/s\n",
+	   $opt{'writers'}, $opt{'rounds'}, $opt{'policy'},
+	   @held / ($end - $begin));
+    printf("handoff latency: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+	   quantile(0.50, @gaps) * 1000, quantile(0.99, @gaps) * 1000,
+	   quantile(1, @gaps) * 1000);
+    return $overlaps || 0;
+}
+
+# Overwrite the first page of the device with one repeated byte, a new
+# byte each time, until killed.
+sub seqread_writer ($) {
+    my($n) = @_;
+    sysopen(DEV, $opt{'device'}, O_WRONLY) || die "$opt{'device'}: $!\n";
+    for (my $i = 0; ; $i++) {
+	my($block) = chr(($n * 37 + $i) % 255 + 1) x 4096;
+	sysseek(DEV, 0, 0) || die "seek: $!\n";
+	syswrite(DEV, $block) == 4096 || die "write: $!\n";
+    }
+}
+
+# Read the first page --rounds times with OSPRDIOCSEQREAD.  Reports the
+# number of torn reads.
+sub seqread_reader ($) {
+    my($out) = @_;
+    my($torn) = 0;
+    for (my $i = 0; $i < $opt{'rounds'}; $i++) {
+	my($data) = `./osprdaccess -S -r 4096 $opt{'device'}`;
+	die "osprdaccess -S failed\n" if $? != 0 || length($data) != 4096;
+	$torn++ if $data !~ /^(.)\1*$/s;
+    }
+    syswrite($out, "$torn\n");
+    exit(0);
+}
+
+# Start the --seqread and --checksum writers.  Returns their pids.
+sub start_page_writers () {
+    my(@writers);
+    for (my $i = 0; $i < $opt{'writers'}; $i++) {
+	my($pid) = fork;
+	die "fork: $!\n" if !defined($pid);
+	seqread_writer($i) if $pid == 0;
+	push(@writers, $pid);
+    }
+    return @writers;
+}
+
+# Run the lockless read test.  Returns the number of torn reads.
+sub run_seqread () {
+    my(@writers) = start_page_writers();
+
+    pipe(RESULTS, OUT) || die "pipe: $!\n";
+    my($begin) = time;
+    my(@readers);
+    for (my $i = 0; $i < $opt{'readers'}; $i++) {
+	my($pid) = fork;
+	die "fork: $!\n" if !defined($pid);
+	if ($pid == 0) {
+	    close(RESULTS);
+	    seqread_reader(\*OUT);
+	}
+	push(@readers, $pid);
+    }
+    close(OUT);
+    my($torn) = 0;
+    $torn += $_ foreach <RESULTS>;
+    close(RESULTS);
+    my($failed) = 0;
+    foreach my $pid (@readers) {
+	waitpid($pid, 0);
+	$failed++ if $? != 0;
+    }
+    my($end) = time;
+    kill('TERM', @writers);
+    waitpid($_, 0) foreach @writers;
+    die "$failed seqread readers failed\n" if $failed;
+
+    printf("%d readers x %d rounds against %d writers: %.1f reads/s,"
+	   . " %d torn\n", $opt{'readers'}, $opt{'rounds'}, $opt{'writers'},
+	   $opt{'readers'} * $opt{'rounds'} / ($end - $begin), $torn);
+    return $torn;
+}
+
+# Read the first page --rounds times with OSPRDIOCRW.  Reports the number
+# of reads that failed.
+sub checksum_reader ($) {
+    my($out) = @_;
+    my($failed) = 0;
+    for (my $i = 0; $i < $opt{'rounds'}; $i++) {
+	my($data) = `./osprdaccess -V -r 4096 $opt{'device'} 2>/dev/null`;
+	$failed++ if $? != 0 || length($data) != 4096;
+    }
+    syswrite($out, "$failed\n");
+    exit(0);
+}
+
+# Return the device's read checksum errors, scrubber checksum errors, and
+# sectors scrubbed from /proc/osprd.
+sub checksum_counts () {
+    my($name) = ($opt{'device'} =~ m|([^/]+)$|);
+    open(PROC, "/proc/osprd") || die "/proc/osprd: $!\n";
+    my(@counts);
+    while (<PROC>) {
+	@counts = ($1, $2, $3)
+	    if /^$name: .*checksum errors (\d+) read (\d+) scrub \((\d+) sectors/;
+    }
+    close(PROC);
+    die "$opt{'device'}: no checksums; load the module with checksum=1\n"
+	if !@counts;
+    return @counts;
+}
+
+# Run the checksum test.  Returns a list of failures.
+sub run_checksum () {
+    my(@before) = checksum_counts();
+    my(@writers) = start_page_writers();
+
+    pipe(RESULTS, OUT) || die "pipe: $!\n";
+    my(@readers);
+    for (my $i = 0; $i < $opt{'readers'}; $i++) {
+	my($pid) = fork;
+	die "fork: $!\n" if !defined($pid);
+	if ($pid == 0) {
+	    close(RESULTS);
+	    checksum_reader(\*OUT);
+	}
+	push(@readers, $pid);
+    }
+    close(OUT);
+    my($failed) = 0;
+    $failed += $_ foreach <RESULTS>;
+    close(RESULTS);
+    waitpid($_, 0) foreach @readers;
+    kill('TERM', @writers);
+    waitpid($_, 0) foreach @writers;
+    # Give the scrubber time for at least one batch
+    sleep(1.5);
+    my(@after) = checksum_counts();
+
+    printf("%d readers x %d rounds against %d writers: %d failed reads,"
+	   . " %d read and %d scrub checksum errors, %d sectors scrubbed\n",
+	   $opt{'readers'}, $opt{'rounds'}, $opt{'writers'}, $failed,
+	   $after[0] - $before[0], $after[1] - $before[1],
+	   $after[2] - $before[2]);
+    my(@failures);
+    push(@failures, "$failed reads failed") if $failed;
+    push(@failures, "reads found checksum errors") if $after[0] > $before[0];
+    push(@failures, "the scrubber found checksum errors")
+	if $after[1] > $before[1];
+    push(@failures, "the scrubber checked nothing") if $after[2] == $before[2];
+    return @failures;
+}
+
+if ($opt{'checksum'}) {
+    my(@failures) = run_checksum();
+    if (@failures) {
+	print STDERR "Checksum test FAILED!\n";
+	print STDERR "  $_\n" foreach @failures;
+	exit(1);
+    }
+    exit(0);
+}
+
+if ($opt{'seqread'}) {
+    my($torn) = run_seqread();
+    if ($torn) {
+	print STDERR "Seqread test FAILED!\n  $torn reads were torn\n";
+	exit(1);
+    }
+    exit(0);
+}
+
+if ($opt{'handoff'}) {
+    set_policy($opt{'policy'});
+    my($overlaps) = run_handoff();
+    if ($overlaps) {
+	print STDERR "Handoff test FAILED!\n  $overlaps write locks overlapped\n";
+	exit(1);
+    }
+    exit(0);
+}
+
+if ($opt{'bench'}) {
+    printf("%-10s %9s %9s %9s %9s %9s\n", "policy", "locks/s",
+	   "rd p50", "rd p99", "wr p50", "wr p99");
+    foreach my $name (sort { $policies{$a} <=> $policies{$b} } keys %policies) {
+	if ($name ne 'fifo' && $> != 0) {
+	    printf("%-10s (needs root)\n", $name);
+	    next;
+	}
+	$opt{'policy'} = $name;
+	set_policy($name);
+	srand($opt{'seed'});
+	my(%stats) = run_stress();
+	printf("%-10s %9.1f %9.1f %9.1f %9.1f %9.1f%s\n", $name, $stats{'rate'},
+	       $stats{'read p50'}, $stats{'read p99'},
+	       $stats{'write p50'}, $stats{'write p99'},
+	       @{$stats{'failures'}} ? "  (" . join("; ", @{$stats{'failures'}}) . ")" : "");
+    }
+    set_policy('fifo', 1) if $> == 0;
+    exit(0);
+}
+
+set_policy($opt{'policy'});
+my(%stats) = run_stress();
+printf("%d lockers (seed %d, policy %s): %d granted, %d busy, %d abandoned\n",
+       $stats{'lockers'}, $opt{'seed'}, $opt{'policy'}, $stats{'granted'},
+       $stats{'busy'}, $stats{'abandoned'});
+printf("acquire latency: p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+       $stats{'p50'}, $stats{'p99'}, $stats{'max'});
+printf("  readers: p50 %.1f ms, p99 %.1f ms; writers: p50 %.1f ms, p99 %.1f ms\n",
+       $stats{'read p50'}, $stats{'read p99'}, $stats{'write p50'}, $stats{'write p99'});
+printf("throughput: %.1f locks/s over %.2f s\n", $stats{'rate'}, $stats{'time'});
+
+if (@{$stats{'failures'}}) {
+    print STDERR "Stress test FAILED!\n";
+    print STDERR "  $_\n" foreach @{$stats{'failures'}};
+    exit(1);
+}
+print "Stress test passed\n";
+exit(0);
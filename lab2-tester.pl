@@ -166,6 +166,146 @@ close FOO;
       ') 2>/dev/null',
       "aX"
     ],
+
+# striping across devices
+    # 18
+    [ '(echo -n abcdefgh | ./osprdaccess -w 8 -s 2 /dev/osprda /dev/osprdb) && ' .
+      './osprdaccess -r 4 /dev/osprda && ' .
+      './osprdaccess -r 8 -s 2 /dev/osprda /dev/osprdb',
+      "abefabcdefgh"
+    ],
+
+# write-back writes
+    # 19
+    [ '(echo -n back | ./osprdaccess -w -b -o 1) && ' .
+      './osprdaccess -r 5 | hexdump -C',
+      "00000000 00 62 61 63 6b |.back| 00000005"
+    ],
+
+# trace and replay
+    # 20
+    [ '(echo -n trace | ./osprdaccess -w -o 2 -l -T lab2test.trace) && ' .
+      'cut -d" " -f3- lab2test.trace && ' .
+      './osprdreplay -f lab2test.trace > /dev/null && ' .
+      './osprdaccess -r 8 | hexdump -C; rm -f lab2test.trace',
+      "/dev/osprda open-w 0 0 /dev/osprda lock 0 0 /dev/osprda write 2 5 " .
+      "/dev/osprda unlock 0 0 /dev/osprda close 0 0 " .
+      "00000000 00 00 00 00 00 00 00 00 |........| 00000008"
+    ],
+
+# batched vector I/O, checked against ordinary reads and writes
+    # 21
+    [ '(echo -n sector1 | ./osprdaccess -w 1024 -o 512 -V -l) && ' .
+      '(echo -n x | ./osprdaccess -w -o 1030) && ' .
+      '(./osprdaccess -r 1024 -o 512 -V | hexdump -C) && ' .
+      '(./osprdaccess -r 8 -o 512 | hexdump -C)',
+      "00000000 73 65 63 74 6f 72 31 00 00 00 00 00 00 00 00 00 |sector1.........| " .
+      "00000010 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |................| " .
+      "* " .
+      "00000200 00 00 00 00 00 00 78 00 00 00 00 00 00 00 00 00 |......x.........| " .
+      "00000210 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |................| " .
+      "* " .
+      "00000400 " .
+      "00000000 73 65 63 74 6f 72 31 00 |sector1.| 00000008"
+    ],
+
+# querying the lock state while two readers wait for a writer
+    # 22
+    [ '(echo aaa | ./osprdaccess -w 3 -l -d 0.6) & ' .
+      '(sleep 0.2 ; ./osprdaccess -r 1 -l > /dev/null) & ' .
+      '(sleep 0.2 ; ./osprdaccess -r 1 -l > /dev/null) & ' .
+      'sleep 0.4 ; ./osprdaccess -q | head -4 ; wait',
+      "write_locked 1 readers 0 queued 2 waiters 2"
+    ],
+
+# resizing: growing replaces the short last chunk but keeps its data
+    # 23
+    [ '(echo grow | ./osprdaccess -w -o 512) && ' .
+      './osprdaccess -w 0 -R 8192 && ' .
+      '(echo end | ./osprdaccess -w -o 4194300) && ' .
+      './osprdaccess -r 4 -o 512 && echo && ' .
+      './osprdaccess -r 3 -o 4194300 && echo && ' .
+      './osprdaccess -w -z -o 16384 && ./osprdaccess -w 0 -R 32',
+      "grow end"
+    ],
+
+# resizing: shrinking over data fails and keeps it
+    # 24
+    [ '(echo data | ./osprdaccess -w -o 8192) && ' .
+      './osprdaccess -w 0 -R 8 ; ' .
+      './osprdaccess -r 4 -o 8192',
+      "ioctl OSPRDIOCRESIZE: Device or resource busy data"
+    ],
+
+# resizing: shrinking over zeros works
+    # 25
+    [ '(echo tail | ./osprdaccess -w -o 8192) && ' .
+      './osprdaccess -w -z -o 8192 && ' .
+      './osprdaccess -w 0 -R 16 && ' .
+      './osprdaccess -r | wc -c ; ./osprdaccess -w 0 -R 32',
+      "8192"
+    ],
+
+# I/O limits: a process over its limit does not hold up another one
+    # 26
+    [ '(./osprdaccess -r 0 -Q 20 0 && ' .
+      '(./osprdaccess -r 16384 -V > /dev/null & p=$! ; ' .
+      'sleep 1 ; kill $p && echo throttled) & ' .
+      '(sleep 0.3 ; ./osprdaccess -r 1024 -V > /dev/null & p=$! ; ' .
+      'sleep 0.3 ; kill $p || echo free) ; ' .
+      'wait ; ./osprdaccess -r 0 -Q 0 0) 2>/dev/null',
+      "free throttled"
+    ],
+
+# lock leases: a waiter takes an expired lock, and the holder's I/O fails
+    # 27
+    [ '(echo aaa | ./osprdaccess -w 3 -E 300 -l -d 1) & ' .
+      '(sleep 0.2 ; echo bbb | ./osprdaccess -w 3 -l && echo took) & ' .
+      'wait ; ./osprdaccess -r 3 ; ./osprdaccess -r 0 -E 0',
+      "took write: No locks available bbb"
+    ],
+
+# lock leases: so does unlocking an expired lock
+    # 28
+    [ '(./osprdaccess -w 0 -E 300 -l -d 1) & ' .
+      '(sleep 0.2 ; ./osprdaccess -r 0 -l && echo took) & ' .
+      'wait ; ./osprdaccess -r 0 -E 0',
+      "took ioctl OSPRDIOCRELEASE: No locks available"
+    ],
+
+# lock leases: renewing keeps the lock past the lease
+    # 29
+    [ '(echo aaa | ./osprdaccess -w 3 -E 300 -l -d 1 -e 0.1 && echo held) & ' .
+      '(sleep 0.2 ; echo bbb | ./osprdaccess -w 3 -l && echo later) & ' .
+      'wait ; ./osprdaccess -r 3 ; ./osprdaccess -r 0 -E 0',
+      "held later bbb"
+    ],
+
+# lock scheduling policies: a bad one is refused
+    # 30
+    [ './osprdaccess -r 0 -P 9',
+      "ioctl OSPRDIOCSETPOLICY: Invalid argument"
+    ],
+
+# lock scheduling policies: under READERS, a reader passes a queued writer
+    # 31
+    [ './osprdaccess -r 0 -P 1 ; ' .
+      '(./osprdaccess -r 0 -l -d 0.6) & ' .
+      '(sleep 0.1 ; echo b | ./osprdaccess -w 1 -l && echo wrote) & ' .
+      '(sleep 0.2 ; ./osprdaccess -r 0 -l && echo read) & ' .
+      'wait ; ./osprdaccess -r 0 -P 0',
+      "read wrote"
+    ],
+
+# trace and replay: each process releases its lock when it did
+    # 32
+    [ '(echo aaa | ./osprdaccess -w 3 -l -d 0.2 -T lab2test.trace) & ' .
+      '(sleep 0.1 ; echo bbb | ./osprdaccess -w 3 -l -T lab2test.trace) & ' .
+      'wait ; ./osprdreplay lab2test.trace | ' .
+      'awk \'$1 == "lock" || $1 == "unlock" { print $1, $2, $3 }\' ; ' .
+      'rm -f lab2test.trace',
+      "lock 2 0 unlock 2 0"
+    ],
     );
 
 my($ntest) = 0;
@@ -13,6 +13,26 @@
 #include <linux/blkdev.h>
 #include <linux/wait.h>
 #include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/gfp.h>
+#include <linux/nodemask.h>
+#include <linux/proc_fs.h>
+#include <linux/bio.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/ioprio.h>
+#include <linux/capability.h>
+#include <linux/mempool.h>
+#include <linux/zlib.h>
+#include <asm/processor.h>
+#include <asm/atomic.h>
+#include <asm/div64.h>
+#include <asm/uaccess.h>
 
 #include "spinlock.h"
 #include "osprd.h"
@@ -20,6 +40,16 @@
 /* The size of an OSPRD sector. */
 #define SECTOR_SIZE	512
 
+/* A device's data is stored in chunks of this many sectors (2 MiB, the size
+ * of a huge page on x86).  Only the last chunk may be shorter. */
+#define OSPRD_CHUNK_SHIFT	12
+#define OSPRD_CHUNK_SECTORS	(1U << OSPRD_CHUNK_SHIFT)
+
+/* With 'seqread', each of a device's OSPRD_SEQ_LOCKS sequence counters
+ * covers every OSPRD_SEQ_LOCKS'th run of this many sectors (64 KiB). */
+#define OSPRD_SEQ_SHIFT		7
+#define OSPRD_SEQ_LOCKS		64
+
 /* This flag is added to an OSPRD file's f_flags to indicate that the file
  * is locked. */
 #define F_OSPRD_LOCKED	0x80000
@@ -38,14 +68,159 @@ MODULE_AUTHOR("Neeraj Khurana & Evan Shi");
 
 #define OSPRD_MAJOR	222
 
+#define NOSPRD 4
+
 /* This module parameter controls how big the disk will be.
  * You can specify module parameters when you load the module,
  * as an argument to insmod: "insmod osprd.ko nsectors=4096" */
 static int nsectors = 32;
 module_param(nsectors, int, 0);
 
+/* This module parameter builds a RAID-0 device, /dev/osprde, that stripes
+ * its sectors across some of the other devices.  It lists the member
+ * devices by letter: "insmod osprd.ko raid0=abcd" stripes across all four.
+ * 'raid0_chunk' is the number of consecutive sectors stored on one member
+ * before moving on to the next. */
+static char *raid0 = "";
+module_param(raid0, charp, 0);
+static int raid0_chunk = 8;
+module_param(raid0_chunk, int, 0);
+
+/* This module parameter builds a mirrored device, /dev/osprdf, in the same
+ * way.  Writes go to every member; each read is served by the member with
+ * the fewest transfers in flight, preferring memory on the reader's NUMA
+ * node.  Any member can stand in for the others. */
+static char *mirror = "";
+module_param(mirror, charp, 0);
+
+/* This module parameter makes read locks scale across CPUs: each CPU counts
+ * its own readers, and writers add up the counts ("big-reader" locking).
+ * Use it when read locks are taken far more often than write locks. */
+static int brlock = 0;
+module_param(brlock, int, 0);
+
+/* This module parameter is every device's initial lock scheduling policy
+ * (an OSPRD_POLICY_* value from osprd.h; OSPRDIOCSETPOLICY changes it).
+ * Under OSPRD_POLICY_READERS, at most 'policy_bypass' readers in a row may
+ * pass a queued writer.  /sys/module/osprd/parameters/policy_bypass can
+ * change that at any time. */
+static int policy = OSPRD_POLICY_FIFO;
+module_param(policy, int, 0);
+static int policy_bypass = 16;
+module_param(policy_bypass, int, 0644);
+
+/* This module parameter is every device's initial lock lease, in ms
+ * (OSPRDIOCSETLEASE changes it).  A lock holder must renew its lease with
+ * OSPRDIOCRENEW before it runs out, or a waiting process takes the lock
+ * away from it.  Revocation stops only read(), write(), and OSPRDIOCRW.
+ * 0 means locks never expire. */
+static int lease_ms = 0;
+module_param(lease_ms, int, 0);
+
+/* This module parameter switches the devices to multi-queue mode: instead
+ * of queueing requests behind one lock per device and copying them one at a
+ * time, every process copies its own I/O on its own CPU as it submits it,
+ * and completes it right away.  Transfers to different sectors then run in
+ * parallel on all CPUs.  The lock still orders conflicting access. */
+static int mq = 0;
+module_param(mq, int, 0);
+
+/* This module parameter lets readers skip the device lock.  With 'seqread',
+ * every write to a device's data bumps a sequence counter before and after,
+ * and OSPRDIOCSEQREAD copies up to a page of sectors without taking a
+ * ticket, copying again if the counter shows that a write ran meanwhile.
+ * Each counter covers only part of the device, so only writes that share a
+ * counter are serialized by its lock. */
+static int seqread = 0;
+module_param(seqread, int, 0);
+
+/* This module parameter lists the devices that use write-back caching:
+ * "writeback=1,1,0,0" lets writes to osprda and osprdb sit in the page
+ * cache instead of going to the device before write() returns.  fsync()
+ * still waits for them, and so does releasing a write lock.  A single open
+ * file can also switch modes with OSPRDIOCSETSYNC. */
+static int writeback[NOSPRD];
+module_param_array(writeback, int, NULL, 0);
+
+/* These module parameters limit how fast each process may do I/O on each
+ * device: at most 'qos_iops' bios and 'qos_kbps' KiB per second, where 0
+ * means no limit.  A process over its limit sleeps before its I/O reaches
+ * the queue, so one bulk writer cannot fill the queue ahead of everyone
+ * else.  I/O priority classes (see ionice(1)) count in only two ways:
+ * real-time processes are never limited, and without 'mq' their I/O skips
+ * the queue entirely; idle-class processes get a quarter of the limits,
+ * which matters only when a limit is set.  The queue itself is still
+ * drained in the order the elevator hands requests over, and best-effort
+ * priority levels are ignored.  OSPRDIOCSETQOS changes one device's limits, and /proc/osprd shows how
+ * much I/O was held back. */
+static int qos_iops = 0;
+module_param(qos_iops, int, 0);
+static int qos_kbps = 0;
+module_param(qos_kbps, int, 0);
+
+/* This module parameter turns on per-sector CRC32C checksums.  Writes store
+ * each sector's checksum; reads check it and fail with -EIO on a mismatch
+ * (a mirror then reads from another member and repairs the bad copy).  A
+ * background thread also scrubs every device at 'scrub_kbps' KiB/s, which
+ * /sys/module/osprd/parameters/scrub_kbps can change (0 pauses it).
+ * /proc/osprd counts the errors found. */
+static int checksum = 0;
+module_param(checksum, int, 0);
+static int scrub_kbps = 4096;
+module_param(scrub_kbps, int, 0644);
+
+/* These module parameters control where each device's data lives.
+ * 'numa_node' binds devices to NUMA nodes, in order: "numa_node=0,0,1,1"
+ * puts osprda and osprdb on node 0 and the others on node 1.  Devices
+ * without a node (or with node -1) take their memory from the node that
+ * loads the module, or, with 'interleave', spread their chunks over every
+ * online node.  'hugepages' backs chunks with physically contiguous
+ * high-order pages, which the kernel maps with large TLB entries; chunks
+ * fall back to vmalloc() when no such pages are free.  /proc/osprd shows
+ * where the chunks ended up. */
+static int numa_node[NOSPRD] = { [0 ... NOSPRD - 1] = -1 };
+module_param_array(numa_node, int, NULL, 0);
+static int interleave = 0;
+module_param(interleave, int, 0);
+static int hugepages = 0;
+module_param(hugepages, int, 0);
+
+/* This module parameter compresses cold data.  With "compress=S", a
+ * background thread compresses every page of device data that nobody has
+ * read or written for S seconds, using zlib at its fastest level, and frees
+ * the page.  The next transfer that touches a compressed page decompresses
+ * it, and it stays uncompressed while it is in use.  All-zero pages take no
+ * memory at all while cold.  Chunks are then built from single pages, so
+ * 'hugepages' has no effect.  /proc/osprd shows the compression ratio and
+ * how long decompression takes.  S is capped at a day. */
+static int compress = 0;
+module_param(compress, int, 0);
+
+/* This module parameter turns on trace points: a mask of the OSPRD_TRACE_*
+ * event classes below.  /sys/module/osprd/parameters/trace changes it at any
+ * time.  Each event logs one "osprd-trace:" line with the disk, the pid, and
+ * a nanosecond timestamp, so lock hold times can be lined up with I/O.
+ * While tracing is off, a trace point costs one predicted branch. */
+static int trace = 0;
+module_param(trace, int, 0644);
+
+#define OSPRD_TRACE_LOCK	1	// Tickets, waits, grants, releases,
+					// abandoned and revoked locks
+#define OSPRD_TRACE_REQUEST	2	// Request start and completion
+
+#define osprd_trace(class, d, format, ...)				\
+	do {								\
+		if (unlikely(trace & (class)))				\
+			printk(KERN_DEBUG "osprd-trace: %s %d %llu " format "\n", \
+			       (d)->gd->disk_name, current->pid,	\
+			       (unsigned long long) sched_clock(),	\
+			       ## __VA_ARGS__);				\
+	} while (0)
+
 typedef struct read_list_node {
 	pid_t reader;
+	struct file *filp;		// The file holding the read lock
+	unsigned long expires;		// When its lease runs out (jiffies)
 	struct read_list_node *next;
 } read_list_node;
 
@@ -58,10 +233,116 @@ typedef struct dead_tix_node {
 
 typedef dead_tix_node* dead_tix_t;
 
+/* One CPU's share of a device's read locks when 'brlock' is set. */
+typedef struct osprd_reader_slot {
+	osp_spinlock_t lock;		// Protects this slot
+	int count;			// Read locks taken on this CPU
+	read_list_t read_list;		// and the readers holding them
+} ____cacheline_aligned_in_smp osprd_reader_slot_t;
+
+/* A lock request waiting for its turn.  Lives on the requester's stack. */
+typedef struct wait_list_node {
+	unsigned ticket;		// The request's ticket
+	int dir;			// READ or WRITE
+	pid_t pid;			// The requesting process
+	struct file *filp;		// and the file it is locking through
+	read_list_t node;		// The holder's read_list entry, or
+					// d->write_node, allocated in advance
+	dead_tix_t dead;		// A dead ticket node for 'ticket',
+					// also allocated in advance; taken
+					// if it is retired out of order
+	unsigned long since;		// When the ticket was taken (jiffies)
+	struct task_struct *task;	// The task waiting
+	int granted;			// Set once the lock is handed to it
+	struct wait_list_node *next;
+} wait_list_node;
+
+typedef wait_list_node* wait_list_t;
+
+/* The I/O a process may still start on a device before it is throttled;
+ * see osprd_throttle(). */
+typedef struct osprd_bucket {
+	pid_t tgid;			// The process it belongs to, or 0
+	unsigned long last;		// When the bucket was last filled
+	long ios;			// Bios left
+	long sectors;			// and sectors left
+} osprd_bucket_t;
+
+#define OSPRD_QOS_BUCKETS	64	// Buckets per device
+#define OSPRD_QOS_PROBE		4	// Buckets a process may use
+
+/* With 'compress', one page of a chunk.  A page is resident ('data' is
+ * set), compressed ('z' holds 'zlen' bytes), or all zeros (neither). */
+typedef struct osprd_zpage {
+	uint8_t *data;			// The page, while resident
+	void *z;			// Its compressed form, while cold
+	unsigned short zlen;
+	unsigned short incompressible;	// 1 if compressing it did not pay;
+					// cleared when it is written
+	unsigned long atime;		// When it was last read or written
+} osprd_zpage_t;
+
+#define SECTORS_PER_PAGE	(PAGE_SIZE / SECTOR_SIZE)
+#define OSPRD_CHUNK_PAGES	(OSPRD_CHUNK_SECTORS / SECTORS_PER_PAGE)
+
+/* One chunk of a device's data. */
+typedef struct osprd_chunk {
+	uint8_t *data;			// OSPRD_CHUNK_SECTORS sectors, or fewer
+	unsigned nsect;			// for the last chunk
+	int node;			// The NUMA node holding 'data'
+	int order;			// Page order if 'data' is one block of
+					// pages, or -1 if it was vmalloc()ed
+	int zeroed;			// 0 until the data is cleared; see
+					// osprd_chunk_ready()
+	DECLARE_BITMAP(zclaimed, OSPRD_CHUNK_PAGES);	// Pages being zeroed,
+	DECLARE_BITMAP(zdone, OSPRD_CHUNK_PAGES);	// pages zeroed, and
+	atomic_t zpending;				// how many are not yet
+
+	osprd_zpage_t *zpages;		// With 'compress', the data page by
+	spinlock_t zlock;		// page instead of 'data', and the lock
+					// every access to a page holds
+
+	u32 *crc;			// With 'checksum', each sector's CRC32C
+	atomic_t writers;		// Writes in progress, and writes done,
+	atomic_t generation;		// so checks can tell a torn read from
+					// a corrupt sector
+	atomic_t stall;			// Reads holding off new writes after
+					// losing too many races with them
+} osprd_chunk_t;
+
+/* Layouts of composite devices. */
+#define OSPRD_PLAIN	0		// Not composite: has its own data
+#define OSPRD_RAID0	1		// Striped over the members
+#define OSPRD_MIRROR	2		// Copied to every member
+
 /* The internal representation of our device. */
 typedef struct osprd_info {
-	uint8_t *data;                  // The data array. Its size is
-	                                // (nsectors * SECTOR_SIZE) bytes.
+	osprd_chunk_t *chunks;		// The data, in 'nchunks' chunks
+	unsigned nchunks;		// covering (nsectors * SECTOR_SIZE)
+					// bytes
+
+	unsigned nsectors;		// The device's size in sectors
+
+	int node;			// The NUMA node holding the data, or -1
+					// if it is spread over several nodes
+
+	int writeback;			// 1 if opening does not set O_SYNC
+
+	atomic_t crc_errors;		// Checksum errors found by reads
+	atomic_t scrub_errors;		// and by the scrubber
+	unsigned long scrubbed;		// Sectors the scrubber has checked
+
+	atomic_t inflight;		// Number of transfers in progress
+
+	int layout;			// OSPRD_PLAIN, or how a composite
+					// device spreads its sectors over
+	int nmembers;			// its 'nmembers' member devices
+	struct osprd_info *members[NOSPRD]; // (a composite has no chunks)
+
+	int resizing;			// 1 while the chunk table changes; see
+	wait_queue_head_t resizeq;	// osprd_resize()
+	unsigned next_member;		// Where a mirror starts looking for
+					// a replica to read from
 
 	osp_spinlock_t mutex;           // Mutex for synchronizing access to
 					// this block device
@@ -87,17 +368,63 @@ typedef struct osprd_info {
 	read_list_t read_list;
 	dead_tix_t dead_tix;
 
+	int writers;			// Writers holding or queued for the
+					// lock; keeps fast-path readers out
+	osprd_reader_slot_t *readers;	// Per-CPU read locks, with 'brlock'
+
+	wait_list_t wait_list;		// Blocked lock requests, in ticket
+					// order
+	int policy;			// Lock scheduling policy
+	int bypassed;			// Readers that passed a queued writer
+					// since a writer last got the lock
+	unsigned read_phase_end;	// Under OSPRD_POLICY_PHASEFAIR, readers
+					// with earlier tickets may pass writers
+	unsigned abandoned;		// Lock requests given up after a signal
+
+	unsigned long lease;		// Lock lease length in jiffies, or 0
+	read_list_t write_node;		// The write lock's holder,
+	unsigned long write_expires;	// and when its lease runs out
+	read_list_t revoked;		// Holders whose leases ran out, until
+					// they unlock or lock again
+
+	spinlock_t qos_lock;		// Protects the I/O limits:
+	unsigned qos_iops;		// bios per second per process, or 0
+	unsigned qos_kbps;		// KiB per second per process, or 0
+	osprd_bucket_t buckets[OSPRD_QOS_BUCKETS]; // Hashed by tgid
+	unsigned long throttled;	// Bios delayed by the limits
+	unsigned long throttle_ms;	// and how long they waited in total
+
+	spinlock_t zstat_lock;		// Protects the decompression counts:
+	unsigned long inflated;		// Pages decompressed
+	unsigned long long inflate_ns;	// and how long that took in total
+	unsigned long inflate_max_ns;	// and at most
+
+	unsigned long setup_ms;		// When, after loading began, the chunks
+					// were allocated
+	unsigned long zero_ms;		// and the last one was zeroed, or 0
+	atomic_t zeroed_by_io;		// Chunks zeroed by their first transfer
+
+	seqlock_t seqlocks[OSPRD_SEQ_LOCKS]; // With 'seqread', held around
+					// writes to the sectors they cover
+	atomic_t seq_retries;		// OSPRDIOCSEQREAD copies done again
+	atomic_t seq_fallbacks;		// and ones that had to hold 'seqlocks'
+
 	// The following elements are used internally; you don't need
 	// to understand them.
 	struct request_queue *queue;    // The device request queue.
 	spinlock_t qlock;		// Used internally for mutual
 	                                //   exclusion in the 'queue'.
 	struct gendisk *gd;             // The generic disk.
+	make_request_fn *queue_make_request; // The queue's own bio handler
 } osprd_info_t;
 
-#define NOSPRD 4
 static osprd_info_t osprds[NOSPRD];
 
+/* The RAID-0 and mirrored devices built from some of the osprds[]
+ * (see 'raid0' and 'mirror'). */
+static osprd_info_t osprd_raid0;
+static osprd_info_t osprd_mirror;
+
 
 // Declare useful helper functions
 
@@ -121,6 +448,578 @@ static void for_each_open_file(struct task_struct *task,
 						osprd_info_t *user_data),
 			       osprd_info_t *user_data);
 
+/*
+ * osprd_resize(d, filp, nsect)
+ *   Changes the size of 'd' to 'nsect' sectors while it stays in use.
+ */
+static int osprd_resize(osprd_info_t *d, struct file *filp, unsigned long nsect);
+
+static int osprd_is_member(osprd_info_t *m);
+
+/*
+ * osprd_is_revoked(d, filp)
+ *   Returns 1 if the lock held through 'filp' was revoked.
+ */
+static int osprd_is_revoked(osprd_info_t *d, struct file *filp);
+
+
+/*
+ * osprd_io_begin(d), osprd_io_end(d)
+ *   Transfers that do not hold d->qlock (multi-queue I/O and the scrubber)
+ *   run between these, so a resize can wait for them to finish.
+ */
+static void osprd_io_begin(osprd_info_t *d)
+{
+	for (;;) {
+		rcu_read_lock();
+		if (!d->resizing)
+			return;
+		rcu_read_unlock();
+		wait_event(d->resizeq, !d->resizing);
+	}
+}
+
+static inline void osprd_io_end(osprd_info_t *d)
+{
+	rcu_read_unlock();
+}
+
+
+/*
+ * Sector checksums.
+ *
+ * With 'checksum', every sector has a CRC32C.  CPUs with SSE4.2 compute it
+ * with the crc32 instruction, running three independent streams over the
+ * first 3 * CRC_STRIDE bytes of the sector so the instruction's latency is
+ * hidden, then folding them together with the 'crc32c_shift' table.
+ * (The instruction is spelled out in bytes for older assemblers.)  Other
+ * CPUs use slice-by-8 tables.
+ */
+#define CRC_STRIDE	168		// 3 * CRC_STRIDE + 8 == SECTOR_SIZE
+
+static u32 crc32c_table[8][256];	// Slice-by-8 tables
+static u32 crc32c_shift[4][256];	// Appends CRC_STRIDE zero bytes
+static int crc32c_hw;			// 1 if the CPU has SSE4.2
+
+static u32 crc32c_sw(u32 crc, const u8 *p, size_t len)
+{
+	for (; len >= 8; p += 8, len -= 8) {
+		u32 lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (u32) p[3] << 24);
+		u32 hi = p[4] | p[5] << 8 | p[6] << 16 | (u32) p[7] << 24;
+		crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff]
+			^ crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24]
+			^ crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff]
+			^ crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+	}
+	while (len--)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+# ifdef __x86_64__
+#  define CRC32_WORD	".byte 0xf2, 0x48, 0x0f, 0x38, 0xf1, "	// crc32q
+# else
+#  define CRC32_WORD	".byte 0xf2, 0x0f, 0x38, 0xf1, "	// crc32l
+# endif
+
+// The CRC of a sector whose CRC so far was 'crc', using SSE4.2.
+static u32 crc32c_sector_hw(u32 crc, const u8 *p)
+{
+	unsigned long a = crc, b = 0, c = 0;
+	int i;
+
+	for (i = 0; i < CRC_STRIDE; i += sizeof(long)) {
+		asm(CRC32_WORD "0xc1" : "=a" (a)	// %ecx into %eax
+		    : "0" (a), "c" (*(const unsigned long *) (p + i)));
+		asm(CRC32_WORD "0xd6" : "=d" (b)	// %esi into %edx
+		    : "0" (b), "S" (*(const unsigned long *) (p + CRC_STRIDE + i)));
+		asm(CRC32_WORD "0xdf" : "=b" (c)	// %edi into %ebx
+		    : "0" (c), "D" (*(const unsigned long *) (p + 2 * CRC_STRIDE + i)));
+	}
+	a = crc32c_shift[0][a & 0xff] ^ crc32c_shift[1][(a >> 8) & 0xff]
+		^ crc32c_shift[2][(a >> 16) & 0xff] ^ crc32c_shift[3][(a >> 24) & 0xff];
+	a ^= b;
+	a = crc32c_shift[0][a & 0xff] ^ crc32c_shift[1][(a >> 8) & 0xff]
+		^ crc32c_shift[2][(a >> 16) & 0xff] ^ crc32c_shift[3][(a >> 24) & 0xff];
+	a ^= c;
+	for (i = 3 * CRC_STRIDE; i < SECTOR_SIZE; i += sizeof(long))
+		asm(CRC32_WORD "0xc1" : "=a" (a)
+		    : "0" (a), "c" (*(const unsigned long *) (p + i)));
+	return a;
+}
+#endif
+
+// Return the CRC32C of the sector at 'p'.
+static u32 osprd_sector_crc(const u8 *p)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (crc32c_hw)
+		return ~crc32c_sector_hw(~0U, p);
+#endif
+	return ~crc32c_sw(~0U, p, SECTOR_SIZE);
+}
+
+static void crc32c_init(void)
+{
+	static const u8 zeros[CRC_STRIDE];
+	u32 i, j, crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8)
+				^ crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+	for (i = 0; i < 256; i++)
+		for (j = 0; j < 4; j++)
+			crc32c_shift[j][i] = crc32c_sw(i << (8 * j), zeros,
+						       CRC_STRIDE);
+#if defined(__x86_64__) || defined(__i386__)
+	crc32c_hw = (cpuid_ecx(1) & (1 << 20)) != 0;
+#endif
+}
+
+// Report a checksum error in 'sector' of 'd'.
+static void osprd_crc_error(osprd_info_t *d, unsigned sector, atomic_t *count)
+{
+	atomic_inc(count);
+	if (printk_ratelimit())
+		printk(KERN_WARNING "osprd: %s: checksum error in sector %u\n",
+		       d->gd->disk_name, sector);
+}
+
+/*
+ * osprd_check_sectors(c, offset, nsect, buf, generation)
+ *   Checks 'nsect' sectors read from chunk 'c' at 'offset' into 'buf'
+ *   against their checksums.  Returns the index of the first bad sector,
+ *   -1 if they are all good, or -EAGAIN if a write to the chunk may have
+ *   raced with the read, which started at 'generation'.
+ */
+static int osprd_check_sectors(osprd_chunk_t *c, unsigned offset,
+			       unsigned nsect, const u8 *buf, int generation)
+{
+	unsigned i;
+	for (i = 0; i < nsect; i++)
+		if (osprd_sector_crc(buf + i * SECTOR_SIZE) != c->crc[offset + i]) {
+			smp_rmb();
+			if (atomic_read(&c->writers)
+			    || atomic_read(&c->generation) != generation)
+				return -EAGAIN;
+			return i;
+		}
+	return -1;
+}
+
+
+/*
+ * osprd_transfer(d, sector, nsect, buf, dir)
+ *   Copies 'nsect' sectors starting at 'sector' between 'buf' and the
+ *   device's data, in the direction 'dir' (READ or WRITE).
+ *   A composite device hands each piece to the member that stores it.
+ *   Returns 0, or -EIO if a read found a bad checksum.
+ */
+static int osprd_transfer(osprd_info_t *d, unsigned sector, unsigned nsect,
+			  char *buf, int dir);
+
+static int osprd_raid0_transfer(osprd_info_t *d, unsigned sector,
+				unsigned nsect, char *buf, int dir)
+{
+	int r = 0;
+	while (nsect > 0) {
+		unsigned unit = sector / raid0_chunk;
+		unsigned offset = sector % raid0_chunk;
+		unsigned n = min_t(unsigned, nsect, raid0_chunk - offset);
+
+		// Stripe unit 'unit' lives on member (unit % nmembers), as
+		// that member's (unit / nmembers)th chunk.
+		if (osprd_transfer(d->members[unit % d->nmembers],
+				   (unit / d->nmembers) * raid0_chunk + offset,
+				   n, buf, dir) < 0)
+			r = -EIO;
+		sector += n;
+		nsect -= n;
+		buf += n * SECTOR_SIZE;
+	}
+	return r;
+}
+
+// Pick the mirror member to read from: the one with the fewest transfers
+// in flight, with ties going to memory on this CPU's node.  Starting the
+// scan at a rotating member spreads reads over otherwise equal replicas.
+static osprd_info_t *osprd_mirror_replica(osprd_info_t *d)
+{
+	osprd_info_t *best = NULL;
+	int i, best_load = 0, node = numa_node_id();
+	unsigned start = d->next_member++;
+
+	for (i = 0; i < d->nmembers; i++) {
+		osprd_info_t *m = d->members[(start + i) % d->nmembers];
+		int load = atomic_read(&m->inflight);
+		if (!best || load < best_load
+		    || (load == best_load && m->node == node
+			&& best->node != node)) {
+			best = m;
+			best_load = load;
+		}
+	}
+	return best;
+}
+
+// Read from a mirror.  If the chosen member has a bad checksum, read from
+// the others, and repair the bad member with the first good copy.
+static int osprd_mirror_read(osprd_info_t *d, unsigned sector, unsigned nsect,
+			     char *buf)
+{
+	osprd_info_t *bad = osprd_mirror_replica(d);
+	int i;
+
+	if (osprd_transfer(bad, sector, nsect, buf, READ) == 0)
+		return 0;
+	for (i = 0; i < d->nmembers; i++)
+		if (d->members[i] != bad
+		    && osprd_transfer(d->members[i], sector, nsect, buf, READ) == 0) {
+			osprd_transfer(bad, sector, nsect, buf, WRITE);
+			return 0;
+		}
+	return -EIO;
+}
+
+// Copy 'n' sectors between 'buf' and 'data', which holds them for chunk
+// 'c' at 'offset', keeping the chunk's checksums.
+static int osprd_copy_sectors(osprd_info_t *d, osprd_chunk_t *c, uint8_t *data,
+			      unsigned offset, unsigned n, char *buf, int dir)
+{
+	int i, generation, tries = 3;
+
+	if (!c->crc) {
+		if (dir == READ)
+			memcpy(buf, data, n * SECTOR_SIZE);
+		else
+			memcpy(data, buf, n * SECTOR_SIZE);
+		return 0;
+	} else if (dir == WRITE) {
+		// Pairs with the barrier in the read below: either it sees us
+		// in 'writers', or we see it in 'stall' and wait for it
+		for (;;) {
+			atomic_inc(&c->writers);
+			smp_mb();
+			if (!atomic_read(&c->stall))
+				break;
+			atomic_dec(&c->writers);
+			while (atomic_read(&c->stall))
+				cpu_relax();
+		}
+		memcpy(data, buf, n * SECTOR_SIZE);
+		for (i = 0; i < n; i++)
+			c->crc[offset + i] = osprd_sector_crc(data + i * SECTOR_SIZE);
+		atomic_inc(&c->generation);
+		smp_mb();
+		atomic_dec(&c->writers);
+		return 0;
+	}
+
+	// A read that overlaps a write may be torn; try it again
+	do {
+		generation = atomic_read(&c->generation);
+		smp_rmb();
+		memcpy(buf, data, n * SECTOR_SIZE);
+		i = osprd_check_sectors(c, offset, n, (u8 *) buf, generation);
+	} while (i == -EAGAIN && --tries > 0);
+	// A read that keeps losing to writes must still be checked, so hold
+	// new writes off and wait out the ones in progress
+	if (i == -EAGAIN) {
+		atomic_inc(&c->stall);
+		smp_mb();
+		while (atomic_read(&c->writers))
+			cpu_relax();
+		memcpy(buf, data, n * SECTOR_SIZE);
+		i = osprd_check_sectors(c, offset, n, (u8 *) buf,
+					atomic_read(&c->generation));
+		smp_mb();
+		atomic_dec(&c->stall);
+	}
+	if (i >= 0) {
+		osprd_crc_error(d, (c - d->chunks) * OSPRD_CHUNK_SECTORS
+				+ offset + i, &d->crc_errors);
+		return -EIO;
+	}
+	return 0;
+}
+
+
+/*
+ * Cold data compression.
+ *
+ * With 'compress', every access to a page of a chunk holds the chunk's
+ * 'zlock', except zeroing it, which no one else touches until it is done
+ * (see osprd_zero_page()).  A transfer that finds its page compressed
+ * decompresses it on the spot.  Transfers cannot sleep, so the new page is
+ * a GFP_ATOMIC one or, failing that, one from the 'osprd_page_pool'
+ * reserve, and zlib works in a workspace set aside for this CPU.  The
+ * compressor thread (osprd_compress() below) does the slow part, deflating,
+ * on a copy of the page taken under the lock, and frees the page only if
+ * nobody touched it meanwhile.
+ */
+#define OSPRD_PAGE_RESERVE	64	// Pages kept for decompression
+#define OSPRD_ZMAX	(PAGE_SIZE * 3 / 4) // Largest compressed page kept
+#define OSPRD_COLD_MAX	(24 * 60 * 60)	// Longest 'compress' age, seconds
+
+static mempool_t *osprd_page_pool;
+static unsigned long osprd_cold;	// The 'compress' age in jiffies
+static void *osprd_inflate_ws[NR_CPUS];
+
+static inline unsigned osprd_chunk_pages(osprd_chunk_t *c)
+{
+	return (c->nsect + SECTORS_PER_PAGE - 1) / SECTORS_PER_PAGE;
+}
+
+// Make the cold page 'zp' of a chunk of 'd' resident again.  Called with
+// the chunk's zlock held.  Returns 0, or -ENOMEM or -EIO.
+static int osprd_inflate_page(osprd_info_t *d, osprd_zpage_t *zp)
+{
+	unsigned long long start = sched_clock();
+	unsigned long ns;
+	struct page *page;
+	z_stream s;
+	int r;
+
+	if (!(page = mempool_alloc(osprd_page_pool, GFP_ATOMIC))) {
+		if (printk_ratelimit())
+			printk(KERN_WARNING "osprd: %s: out of memory for a "
+			       "cold page\n", d->gd->disk_name);
+		return -ENOMEM;
+	}
+	if (!zp->z) {
+		memset(page_address(page), 0, PAGE_SIZE);
+		zp->data = page_address(page);
+		return 0;
+	}
+
+	s.workspace = osprd_inflate_ws[smp_processor_id()];
+	s.next_in = zp->z;
+	s.avail_in = zp->zlen;
+	s.next_out = page_address(page);
+	s.avail_out = PAGE_SIZE;
+	if ((r = zlib_inflateInit2(&s, -MAX_WBITS)) == Z_OK) {
+		r = zlib_inflate(&s, Z_FINISH);
+		zlib_inflateEnd(&s);
+	}
+	if (r != Z_STREAM_END || s.total_out != PAGE_SIZE) {
+		mempool_free(page, osprd_page_pool);
+		if (printk_ratelimit())
+			printk(KERN_WARNING "osprd: %s: can't decompress a "
+			       "cold page\n", d->gd->disk_name);
+		return -EIO;
+	}
+	kfree(zp->z);
+	zp->z = NULL;
+	zp->data = page_address(page);
+
+	ns = sched_clock() - start;
+	spin_lock(&d->zstat_lock);
+	d->inflated++;
+	d->inflate_ns += ns;
+	if (ns > d->inflate_max_ns)
+		d->inflate_max_ns = ns;
+	spin_unlock(&d->zstat_lock);
+	return 0;
+}
+
+// Copy 'n' sectors between 'buf' and chunk 'c' at 'offset' with 'compress',
+// a page at a time.
+static int osprd_copy_zchunk(osprd_info_t *d, osprd_chunk_t *c,
+			     unsigned offset, unsigned n, char *buf, int dir)
+{
+	int r = 0;
+
+	while (n > 0) {
+		osprd_zpage_t *zp = &c->zpages[offset / SECTORS_PER_PAGE];
+		unsigned in = offset % SECTORS_PER_PAGE;
+		unsigned k = min_t(unsigned, n, SECTORS_PER_PAGE - in);
+
+		spin_lock(&c->zlock);
+		if (!zp->data && osprd_inflate_page(d, zp) < 0)
+			r = -EIO;
+		else {
+			zp->atime = jiffies;
+			if (dir == WRITE)
+				zp->incompressible = 0;
+			if (osprd_copy_sectors(d, c, zp->data + in * SECTOR_SIZE,
+					       offset, k, buf, dir) < 0)
+				r = -EIO;
+		}
+		spin_unlock(&c->zlock);
+		offset += k;
+		n -= k;
+		buf += k * SECTOR_SIZE;
+	}
+	return r;
+}
+
+// Copy 'n' sectors between 'buf' and chunk 'c' at 'offset'.
+static int osprd_copy_chunk(osprd_info_t *d, osprd_chunk_t *c, unsigned offset,
+			    unsigned n, char *buf, int dir)
+{
+	if (c->zpages)
+		return osprd_copy_zchunk(d, c, offset, n, buf, dir);
+	return osprd_copy_sectors(d, c, c->data + offset * SECTOR_SIZE,
+				  offset, n, buf, dir);
+}
+
+/*
+ * Lazy zeroing.
+ *
+ * Chunks are not cleared when they are allocated, so loading the module
+ * and growing a device take no longer than the allocations.  Each chunk is
+ * zeroed by its device's loader thread in the background (see osprd_load())
+ * or by the pages of it that the first transfers touch, whichever comes
+ * first.  Until then, its contents count as zeros.
+ *
+ * Zeroing goes a page at a time and takes no lock, so no one spins or
+ * runs with preemption off for a whole 2 MiB memset: whoever claims a page
+ * clears it and marks it done, and anyone else who needs it waits at most
+ * for that one page.  'zeroed' is set, after a barrier, once every page is
+ * done; until then, only transfers (which check each page they touch)
+ * read the data.
+ */
+
+// Zero page 'j' of chunk 'c' if nobody has yet.  If that was the chunk's
+// last page, count the chunk in 'count', if that is not NULL.
+static void osprd_zero_page(osprd_chunk_t *c, unsigned j, atomic_t *count)
+{
+	if (test_bit(j, c->zdone))
+		goto done;
+	if (test_and_set_bit(j, c->zclaimed)) {
+		// Someone else is at it
+		while (!test_bit(j, c->zdone))
+			cpu_relax();
+		goto done;
+	}
+
+	if (c->zpages)
+		memset(c->zpages[j].data, 0, PAGE_SIZE);
+	else
+		memset(c->data + j * PAGE_SIZE, 0,
+		       min_t(unsigned, SECTORS_PER_PAGE,
+			     c->nsect - j * SECTORS_PER_PAGE) * SECTOR_SIZE);
+	smp_wmb();
+	set_bit(j, c->zdone);
+	// atomic_dec_and_test() is a full barrier, so whoever sees 'zeroed'
+	// also sees every page's zeros
+	if (atomic_dec_and_test(&c->zpending)) {
+		c->zeroed = 1;
+		if (count)
+			atomic_inc(count);
+	}
+ done:
+	smp_rmb();
+}
+
+// Zero all of chunk 'c' that nobody has yet, counting it in 'count' if that
+// is not NULL.  Only for callers that cannot reschedule between pages.
+static void osprd_zero_chunk(osprd_chunk_t *c, atomic_t *count)
+{
+	unsigned j;
+
+	for (j = 0; !c->zeroed && j < osprd_chunk_pages(c); j++)
+		osprd_zero_page(c, j, count);
+	smp_rmb();
+}
+
+// Make sure the pages of chunk 'c' of 'd' holding sectors 'offset' up to
+// 'offset + n' are zeroed before a transfer touches them.
+static inline void osprd_chunk_ready(osprd_info_t *d, osprd_chunk_t *c,
+				     unsigned offset, unsigned n)
+{
+	unsigned j;
+
+	if (likely(c->zeroed)) {
+		smp_rmb();
+		return;
+	}
+	for (j = offset / SECTORS_PER_PAGE;
+	     j <= (offset + n - 1) / SECTORS_PER_PAGE; j++)
+		osprd_zero_page(c, j, &d->zeroed_by_io);
+}
+
+static int osprd_transfer_data(osprd_info_t *d, unsigned sector,
+			       unsigned nsect, char *buf, int dir)
+{
+	unsigned n;
+	int i, r = 0;
+
+	if (d->layout == OSPRD_RAID0)
+		return osprd_raid0_transfer(d, sector, nsect, buf, dir);
+	else if (d->layout == OSPRD_MIRROR) {
+		if (dir == READ)
+			return osprd_mirror_read(d, sector, nsect, buf);
+		for (i = 0; i < d->nmembers; i++)
+			osprd_transfer(d->members[i], sector, nsect, buf, dir);
+		return 0;
+	}
+
+	atomic_inc(&d->inflight);
+	while (nsect > 0) {
+		osprd_chunk_t *c = &d->chunks[sector >> OSPRD_CHUNK_SHIFT];
+		unsigned offset = sector & (OSPRD_CHUNK_SECTORS - 1);
+		n = min_t(unsigned, nsect, OSPRD_CHUNK_SECTORS - offset);
+		osprd_chunk_ready(d, c, offset, n);
+		if (osprd_copy_chunk(d, c, offset, n, buf, dir) < 0)
+			r = -EIO;
+		sector += n;
+		nsect -= n;
+		buf += n * SECTOR_SIZE;
+	}
+	atomic_dec(&d->inflight);
+	return r;
+}
+
+// Return 1 if the sequence counter 'i' covers any of the 'nsect' sectors
+// from 'sector'.  'nsect' is not 0.
+static int osprd_seq_covers(unsigned i, unsigned sector, unsigned nsect)
+{
+	unsigned first = sector >> OSPRD_SEQ_SHIFT;
+	unsigned last = (sector + nsect - 1) >> OSPRD_SEQ_SHIFT;
+	return last - first >= OSPRD_SEQ_LOCKS - 1
+		|| (i - first) % OSPRD_SEQ_LOCKS <= last - first;
+}
+
+// Hold every sequence counter covering the 'nsect' sectors from 'sector'
+// for writing.  They are taken in index order, so writers cannot deadlock.
+static void osprd_seq_lock(osprd_info_t *d, unsigned sector, unsigned nsect)
+{
+	unsigned i;
+	for (i = 0; i < OSPRD_SEQ_LOCKS; i++)
+		if (osprd_seq_covers(i, sector, nsect))
+			write_seqlock(&d->seqlocks[i]);
+}
+
+static void osprd_seq_unlock(osprd_info_t *d, unsigned sector, unsigned nsect)
+{
+	unsigned i;
+	for (i = 0; i < OSPRD_SEQ_LOCKS; i++)
+		if (osprd_seq_covers(i, sector, nsect))
+			write_sequnlock(&d->seqlocks[i]);
+}
+
+static int osprd_transfer(osprd_info_t *d, unsigned sector, unsigned nsect,
+			  char *buf, int dir)
+{
+	int r;
+
+	if (!seqread || dir != WRITE || nsect == 0)
+		return osprd_transfer_data(d, sector, nsect, buf, dir);
+	osprd_seq_lock(d, sector, nsect);
+	r = osprd_transfer_data(d, sector, nsect, buf, dir);
+	osprd_seq_unlock(d, sector, nsect);
+	return r;
+}
+
 
 /*
  * osprd_process_request(d, req)
@@ -145,153 +1044,1567 @@ static void osprd_process_request(osprd_info_t *d, struct request *req)
 	// Your code here.
 	//eprintk("Should process request...\n");
 
-    int byteOffset = req->sector*SECTOR_SIZE;
-    int numBytes = req->current_nr_sectors*SECTOR_SIZE;
-    
+	osprd_trace(OSPRD_TRACE_REQUEST, d, "request %s sector %lu nsect %u",
+		    rq_data_dir(req) == READ ? "read" : "write",
+		    (unsigned long) req->sector, req->current_nr_sectors);
+
     //ensure writing and reading within bounds
-    if (req->sector + req->current_nr_sectors > nsectors)
+    if (req->sector + req->current_nr_sectors > d->nsectors)
     {
         eprintk("Accessing out of bounds");
+	osprd_trace(OSPRD_TRACE_REQUEST, d, "request failed sector %lu",
+		    (unsigned long) req->sector);
         end_request(req,0);
+        return;
     }
     
-    if (rq_data_dir(req)== READ)
-    {
-        //destination,source,#bytes
-        memcpy(req->buffer,d->data+byteOffset,numBytes);
-    }
-    else if (rq_data_dir(req)== WRITE) //WRITE
+    if (osprd_transfer(d, req->sector, req->current_nr_sectors, req->buffer,
+                       rq_data_dir(req)) < 0)
     {
-        memcpy(d->data+byteOffset,req->buffer,numBytes);
-        
+	osprd_trace(OSPRD_TRACE_REQUEST, d, "request failed sector %lu",
+		    (unsigned long) req->sector);
+	end_request(req, 0);
+	return;
     }
-    else end_request(req, 0);
-    
+	osprd_trace(OSPRD_TRACE_REQUEST, d, "request done sector %lu nsect %u",
+		    (unsigned long) req->sector, req->current_nr_sectors);
 	end_request(req, 1);
 }
 
 
-// This function is called when a /dev/osprdX file is opened.
-// You aren't likely to need to change this.
-static int osprd_open(struct inode *inode, struct file *filp)
+/*
+ * I/O rate limits.
+ *
+ * With 'qos_iops' or 'qos_kbps' set, each process has a token bucket on
+ * each device holding the bios and sectors it may still start.  The bucket
+ * fills at the device's limits, up to a tenth of a second's worth, and
+ * every bio takes from it.  A bio that overdraws the bucket goes through
+ * once its process has slept off the debt, so a process that keeps asking
+ * for more is held to its limits on average while short bursts pass at
+ * once.  Buckets are found by hashing the thread group id, and each
+ * records whose it is, so processes never share one.  A process with no
+ * bucket takes a free one, or the one idle longest, among the
+ * OSPRD_QOS_PROBE after its hash.  A bucket idle for a second is full
+ * anyway, so taking it over forgets nothing unless more processes are
+ * busy at once than fit.  2.6.18 has no control groups, so the process
+ * is the unit of isolation.
+ */
+
+// Add 'elapsed' jiffies' worth of tokens at 'rate' per second to 'tokens'.
+static long osprd_bucket_fill(long tokens, unsigned long elapsed,
+			      unsigned long rate)
 {
-	// Always set the O_SYNC flag. That way, we will get writes immediately
-	// instead of waiting for them to get through write-back caches.
-	filp->f_flags |= O_SYNC;
-	return 0;
+	long burst = rate / 10 ? rate / 10 : 1;
+	u64 add;
+
+	if (elapsed >= HZ)
+		return burst;
+	add = (u64) elapsed * rate;
+	do_div(add, HZ);
+	tokens += (long) add;
+	return tokens < burst ? tokens : burst;
 }
 
-static int osprd_wake_cond(osprd_info_t *d, int dir, unsigned localTicket)
+// Return the current process's bucket on 'd', taking one over if it has
+// none.  The caller holds d->qos_lock.
+static osprd_bucket_t *osprd_bucket_find(osprd_info_t *d, unsigned long now)
 {
-	osp_spin_lock(&d->mutex);
-	while(d->dead_tix != NULL)
-	{		
-		if (d->dead_tix->ticket == d->ticket_tail)
-		{
-			dead_tix_t del = d->dead_tix;
-			d->dead_tix = d->dead_tix->next;
-			kfree(del);
-		}
-		else // not in head (must be greater than 1 element)
-		{
-			dead_tix_t itr = d->dead_tix;
-			while(itr->next != NULL && itr->next->ticket != d->ticket_tail)
-				itr = itr->next;
-			
-			if (itr->next != NULL)
-			{
-				dead_tix_t del = itr->next;
-				itr->next = del->next;
-				kfree(del);
-			}
-			else
-				break;;
-		}
-		d->ticket_tail++;
+	pid_t tgid = current->tgid;
+	osprd_bucket_t *b, *victim = NULL;
+	unsigned i;
+
+	for (i = 0; i < OSPRD_QOS_PROBE; i++) {
+		b = &d->buckets[(tgid + i) % OSPRD_QOS_BUCKETS];
+		if (b->tgid == tgid)
+			return b;
+		else if (!victim || (victim->tgid && (!b->tgid
+				|| time_before(b->last, victim->last))))
+			victim = b;
 	}
-		
-	int r;
-	if (dir == READ)
-	{
-		r = (!(d->ramdisk_WriteLocked) && d->ticket_tail==localTicket);
-		//eprintk("TICKET TAIL: %d\n", d->ticket_tail);
-		//eprintk("LOCAL TICKET: %d\n", localTicket);
+	// A new bucket starts full
+	victim->tgid = tgid;
+	victim->last = now - HZ;
+	return victim;
+}
+
+// Return how many jiffies pay off a bucket holding 'tokens' at 'rate'.
+static unsigned long osprd_bucket_wait(long tokens, unsigned long rate)
+{
+	u64 wait;
+
+	if (tokens >= 0)
+		return 0;
+	wait = (u64) -tokens * HZ + rate - 1;
+	do_div(wait, rate);
+	return wait;
+}
+
+/*
+ * osprd_throttle(d, nsect)
+ *   Charges one I/O of 'nsect' sectors to the current process's bucket on
+ *   'd', first sleeping if the process is over the device's limits.
+ *   Returns 1 if the process is in the real-time I/O class, which is never
+ *   limited.
+ */
+static int osprd_throttle(osprd_info_t *d, unsigned nsect)
+{
+	int class = IOPRIO_PRIO_CLASS(current->ioprio);
+	unsigned long iops, sps, now = jiffies, wait = 0;
+	osprd_bucket_t *b;
+
+	if (class == IOPRIO_CLASS_RT)
+		return 1;
+	// Write-back from kernel threads is nobody's to pay for
+	if ((!d->qos_iops && !d->qos_kbps) || !current->mm)
+		return 0;
+
+	spin_lock(&d->qos_lock);
+	iops = d->qos_iops;
+	sps = d->qos_kbps * (1024 / SECTOR_SIZE);
+	if (class == IOPRIO_CLASS_IDLE) {
+		iops = (iops + 3) / 4;
+		sps = (sps + 3) / 4;
 	}
-	else
-	{
-		r = (d->num_ReadLocks==0 && !(d->ramdisk_WriteLocked) && d->ticket_tail==localTicket);
+
+	b = osprd_bucket_find(d, now);
+	if (iops) {
+		b->ios = osprd_bucket_fill(b->ios, now - b->last, iops) - 1;
+		wait = osprd_bucket_wait(b->ios, iops);
 	}
-	osp_spin_unlock(&d->mutex);
-	//eprintk("PID %d COND VALUE: %d\n", current->pid, r);
-	return r;
+	if (sps) {
+		unsigned long w;
+		b->sectors = osprd_bucket_fill(b->sectors, now - b->last, sps)
+			- nsect;
+		if ((w = osprd_bucket_wait(b->sectors, sps)) > wait)
+			wait = w;
+	}
+	b->last = now;
+	if (wait) {
+		d->throttled++;
+		d->throttle_ms += jiffies_to_msecs(wait);
+	}
+	spin_unlock(&d->qos_lock);
+
+	if (wait) {
+		osprd_trace(OSPRD_TRACE_REQUEST, d, "throttle %u ms",
+			    jiffies_to_msecs(wait));
+		schedule_timeout_uninterruptible(wait);
+	}
+	return 0;
 }
 
-// This function is called when a /dev/osprdX file is finally closed.
-// (If the file descriptor was dup2ed, this function is called only when the
-// last copy is closed.)
-static int osprd_close_last(struct inode *inode, struct file *filp)
+/*
+ * osprd_set_qos(d, arg)
+ *   Sets the per-process I/O limits of 'd' from the struct osprd_qos at
+ *   'arg'.  Only the administrator may change them.
+ */
+static int osprd_set_qos(osprd_info_t *d, struct osprd_qos __user *arg)
 {
-	if (filp) {
-		osprd_info_t *d = file2osprd(filp);
-		int filp_writable = filp->f_mode & FMODE_WRITE;
+	struct osprd_qos qos;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&qos, arg, sizeof(qos)))
+		return -EFAULT;
+	if (qos.iops > INT_MAX || qos.kbps > INT_MAX / (1024 / SECTOR_SIZE))
+		return -EINVAL;
+
+	spin_lock(&d->qos_lock);
+	d->qos_iops = qos.iops;
+	d->qos_kbps = qos.kbps;
+	// Everyone starts over with a full bucket
+	memset(d->buckets, 0, sizeof(d->buckets));
+	spin_unlock(&d->qos_lock);
+	return 0;
+}
 
-		// EXERCISE: If the user closes a ramdisk file that holds
-		// a lock, release the lock.  Also wake up blocked processes
-		// as appropriate.
 
-		// Your code here.
+/*
+ * osprd_make_request(q, bio)
+ *   In multi-queue mode ('mq'), and for real-time I/O otherwise, called in
+ *   the submitting process's context for each bio.  Copies each of its
+ *   segments directly, without going through the request queue, then
+ *   completes the bio.
+ */
+static int osprd_make_request(request_queue_t *q, struct bio *bio)
+{
+	osprd_info_t *d = (osprd_info_t *) q->queuedata;
+	unsigned sector = bio->bi_sector;
+	struct bio_vec *bvec;
+	int i, r = 0;
+
+	osprd_throttle(d, bio_sectors(bio));
+	osprd_trace(OSPRD_TRACE_REQUEST, d, "bio %s sector %u nsect %u",
+		    bio_data_dir(bio) == READ ? "read" : "write",
+		    sector, bio->bi_size / SECTOR_SIZE);
+
+	osprd_io_begin(d);
+	if (bio->bi_sector + bio->bi_size / SECTOR_SIZE > d->nsectors) {
+		osprd_io_end(d);
+		eprintk("Accessing out of bounds");
+		osprd_trace(OSPRD_TRACE_REQUEST, d, "bio failed sector %u",
+			    sector);
+		bio_endio(bio, bio->bi_size, -EIO);
+		return 0;
+	}
 
-		// This line avoids compiler warnings; you may remove it.
-		(void) filp_writable, (void) d;
-        
-        osp_spin_lock(&d->mutex);
-        //could also just check if filp->flag is locked
-        if (!d->ramdisk_WriteLocked && d->num_ReadLocks==0)
-        {
-            osp_spin_unlock(&d->mutex);
-            return -EINVAL;
-        }
-        
-        
-        if (filp_writable)
-        {
-            d->ramdisk_WriteLocked=0;
-            d->pid_holdingWriteLock=-1; //ensure no process holds write lock
-			//eprintk("PID %d RELEASED WRITE LOCK\n", current->pid);
-        }
-        else //ramdisk was locked on reading
-        {
-            if (d->read_list != NULL)
-			{
-				//remove current pid from read_pid list	
-				if (d->read_list->reader == current->pid) // read lock in head
-				{
-					read_list_t del = d->read_list;
-					d->read_list = d->read_list->next;
-					kfree(del);
-				}
-				else // not in head (must be greater than 1 element)
-				{
-					read_list_t itr = d->read_list;
-					while(itr->next != NULL && itr->next->reader != current->pid)
-						itr = itr->next;
-					
-					if (itr->next != NULL)
-					{
-						read_list_t del = itr->next;
-						itr->next = itr->next->next;
-						kfree(del);
-					}
-				}
-				d->num_ReadLocks--;
-				//eprintk("PID %d RELEASED READ LOCK\n", current->pid);
-			}
-        }
-        
-        //chnage filp->flag to unlocked (NEEDS TO BE DONE)
-		wake_up_all(&d->blockq);
-        filp->f_flags &= !F_OSPRD_LOCKED;
-        osp_spin_unlock(&d->mutex);
+	bio_for_each_segment(bvec, bio, i) {
+		char *buf = __bio_kmap_atomic(bio, i, KM_USER0);
+		if (osprd_transfer(d, sector, bvec->bv_len / SECTOR_SIZE, buf,
+				   bio_data_dir(bio)) < 0)
+			r = -EIO;
+		__bio_kunmap_atomic(buf, KM_USER0);
+		sector += bvec->bv_len / SECTOR_SIZE;
+	}
+	osprd_io_end(d);
+
+	osprd_trace(OSPRD_TRACE_REQUEST, d, "bio %s sector %lu nsect %u",
+		    r < 0 ? "failed" : "done",
+		    (unsigned long) bio->bi_sector, bio->bi_size / SECTOR_SIZE);
+	bio_endio(bio, bio->bi_size, r);
+	return 0;
+}
+
+
+/*
+ * osprd_queue_bio(q, bio)
+ *   Without 'mq', called in the submitting process's context for each bio
+ *   before it is queued.  Applies the I/O limits, and copies real-time I/O
+ *   directly so it never waits behind queued requests.
+ */
+static int osprd_queue_bio(request_queue_t *q, struct bio *bio)
+{
+	osprd_info_t *d = (osprd_info_t *) q->queuedata;
+
+	if (osprd_throttle(d, bio_sectors(bio)))
+		return osprd_make_request(q, bio);
+	return d->queue_make_request(q, bio);
+}
+
+
+/*
+ * Batched I/O.
+ *
+ * OSPRDIOCRW copies a whole vector of transfers between user memory and a
+ * device in one system call, skipping the page cache and the request
+ * queue.  Data goes through a one-page bounce buffer, so the copy to or
+ * from user memory, which may fault, happens outside osprd_io_begin().
+ * Write-back data for the device is written out before the batch, and
+ * cached pages a write covers are dropped afterwards, so buffered
+ * reads and writes through other files stay coherent with the batch as
+ * long as nobody has those pages mapped.  Each transfer counts as one I/O
+ * against the I/O limits.
+ */
+#define OSPRD_RW_BATCH	16		// Entries copied in at a time
+
+// Do the transfer 'v' of a batch on 'd' through 'filp', using the page
+// 'bounce'.
+static int osprd_rw_one(osprd_info_t *d, struct file *filp,
+			struct osprd_iovec *v, char *bounce)
+{
+	struct address_space *mapping = filp->f_mapping;
+	char __user *ubuf = (char __user *) v->buf;
+	unsigned sector = v->sector, nsect = v->nsect, n;
+	int write = (v->dir == OSPRD_RW_WRITE), r = 0;
+
+	if (v->dir != OSPRD_RW_READ && v->dir != OSPRD_RW_WRITE)
+		return -EINVAL;
+	if (!(filp->f_mode & (write ? FMODE_WRITE : FMODE_READ)))
+		return -EBADF;
+	osprd_throttle(d, nsect);
+
+	for (; nsect > 0; sector += n, nsect -= n, ubuf += n * SECTOR_SIZE) {
+		n = min_t(unsigned, nsect, PAGE_SIZE / SECTOR_SIZE);
+		if (write && copy_from_user(bounce, ubuf, n * SECTOR_SIZE))
+			return -EFAULT;
+
+		osprd_io_begin(d);
+		if (sector >= d->nsectors || n > d->nsectors - sector)
+			r = -EINVAL;
+		else
+			r = osprd_transfer(d, sector, n, bounce,
+					   write ? WRITE : READ);
+		osprd_io_end(d);
+		if (r < 0)
+			return r;
+
+		if (!write && copy_to_user(ubuf, bounce, n * SECTOR_SIZE))
+			return -EFAULT;
+	}
+
+	if (write && v->nsect && mapping->nrpages)
+		invalidate_mapping_pages(mapping,
+			((loff_t) v->sector * SECTOR_SIZE) >> PAGE_CACHE_SHIFT,
+			((loff_t) (v->sector + v->nsect) * SECTOR_SIZE - 1)
+			>> PAGE_CACHE_SHIFT);
+	return 0;
+}
+
+/*
+ * osprd_rw(d, filp, arg)
+ *   Does the batch of transfers described by the struct osprd_rw at 'arg'
+ *   on 'd', in order.  Returns the number of transfers done.  A transfer
+ *   that fails ends the batch; if it was the first, its error is returned.
+ */
+static int osprd_rw(osprd_info_t *d, struct file *filp,
+		    struct osprd_rw __user *arg)
+{
+	struct osprd_iovec iov[OSPRD_RW_BATCH];
+	struct osprd_rw rw;
+	unsigned i, n, done = 0;
+	char *bounce;
+	int r = 0;
+
+	if (copy_from_user(&rw, arg, sizeof(rw)))
+		return -EFAULT;
+	if (rw.count > INT_MAX)
+		return -EINVAL;
+	if (osprd_is_revoked(d, filp)
+	    || ((rw.flags & OSPRD_RW_LOCKED) && !(filp->f_flags & F_OSPRD_LOCKED)))
+		return -ENOLCK;
+	if (!(bounce = (char *) __get_free_page(GFP_KERNEL)))
+		return -ENOMEM;
+
+	osprd_trace(OSPRD_TRACE_REQUEST, d, "rw %u transfers", rw.count);
+	// Write-back data in the page cache is newer than the device's
+	if (filp->f_mapping->nrpages)
+		r = filemap_write_and_wait(filp->f_mapping);
+
+	while (r == 0 && done < rw.count) {
+		n = min_t(unsigned, rw.count - done, OSPRD_RW_BATCH);
+		if (copy_from_user(iov, rw.iov + done, n * sizeof(iov[0]))) {
+			r = -EFAULT;
+			break;
+		}
+		for (i = 0; i < n && r == 0; i++) {
+			// The lease may run out partway through the batch
+			if ((rw.flags & OSPRD_RW_LOCKED)
+			    && (osprd_is_revoked(d, filp)
+				|| !(filp->f_flags & F_OSPRD_LOCKED)))
+				r = -ENOLCK;
+			else if ((r = osprd_rw_one(d, filp, &iov[i], bounce)) == 0)
+				done++;
+		}
+	}
+
+	osprd_trace(OSPRD_TRACE_REQUEST, d, "rw done %u transfers", done);
+	free_page((unsigned long) bounce);
+	return done ? done : r;
+}
+
+
+/*
+ * Optimistic reads.
+ *
+ * With 'seqread', osprd_transfer() holds the sequence counters covering a
+ * write's sectors for writing around it.  Writes whose sectors share no
+ * counter, such as those 'mq' runs in parallel, do not wait for each
+ * other.  OSPRDIOCSEQREAD copies sectors with no ticket and no read_list
+ * entry, and copies them again if a write to them ran meanwhile.  A copy
+ * is at most a page, so it spans at most two counters.  After
+ * OSPRD_SEQ_TRIES tries it holds its counters itself for one last copy, so
+ * a stream of writes cannot starve it.  Like OSPRDIOCRW, it reads what the
+ * device holds, not write-back data still in the page cache.  Composite
+ * devices are left out: their data lives in their members, which can be
+ * written through their own minors, bumping only the members' counters,
+ * so a composite's counters do not cover every write to its data.
+ */
+#define OSPRD_SEQ_TRIES	8
+
+/*
+ * osprd_seqread(d, filp, arg)
+ *   Copies the sectors described by the struct osprd_iovec at 'arg' from
+ *   'd' to user memory, as one consistent snapshot.  Returns -ENOTTY
+ *   without 'seqread', and -EINVAL on a composite device.
+ */
+static int osprd_seqread(osprd_info_t *d, struct file *filp,
+			 struct osprd_iovec __user *arg)
+{
+	struct osprd_iovec v;
+	unsigned first, last, seq_first, seq_last, tries = 0;
+	char *buf;
+	int r;
+
+	if (!seqread)
+		return -ENOTTY;
+	if (copy_from_user(&v, arg, sizeof(v)))
+		return -EFAULT;
+	if (v.dir != OSPRD_RW_READ || v.nsect == 0
+	    || v.nsect > PAGE_SIZE / SECTOR_SIZE || d->layout != OSPRD_PLAIN)
+		return -EINVAL;
+	if (!(filp->f_mode & FMODE_READ))
+		return -EBADF;
+	if (!(buf = kmalloc(v.nsect * SECTOR_SIZE, GFP_KERNEL)))
+		return -ENOMEM;
+	osprd_throttle(d, v.nsect);
+
+	first = (v.sector >> OSPRD_SEQ_SHIFT) % OSPRD_SEQ_LOCKS;
+	last = ((v.sector + v.nsect - 1) >> OSPRD_SEQ_SHIFT) % OSPRD_SEQ_LOCKS;
+
+	osprd_io_begin(d);
+	if (v.sector >= d->nsectors || v.nsect > d->nsectors - v.sector)
+		r = -EINVAL;
+	else
+		do {
+			if (++tries > OSPRD_SEQ_TRIES) {
+				atomic_inc(&d->seq_fallbacks);
+				osprd_seq_lock(d, v.sector, v.nsect);
+				r = osprd_transfer(d, v.sector, v.nsect, buf, READ);
+				osprd_seq_unlock(d, v.sector, v.nsect);
+				break;
+			} else if (tries > 1)
+				atomic_inc(&d->seq_retries);
+			seq_first = read_seqbegin(&d->seqlocks[first]);
+			seq_last = read_seqbegin(&d->seqlocks[last]);
+			r = osprd_transfer(d, v.sector, v.nsect, buf, READ);
+		} while (read_seqretry(&d->seqlocks[first], seq_first)
+			 | read_seqretry(&d->seqlocks[last], seq_last));
+	osprd_io_end(d);
+
+	if (r == 0 && copy_to_user((char __user *) v.buf, buf,
+				   v.nsect * SECTOR_SIZE))
+		r = -EFAULT;
+	kfree(buf);
+	return r;
+}
+
+
+/*
+ * The scrubber.
+ *
+ * With 'checksum', a kernel thread checks every sector of every device
+ * against its checksum in the background, sleeping between batches to stay
+ * under 'scrub_kbps' KiB/s.  It finds corruption in data nobody reads.
+ */
+#define SCRUB_BATCH	128		// Sectors checked between sleeps
+
+static struct task_struct *osprd_scrubber;
+
+// Check the sector 'sector' of 'd', if the device still has it.
+static void osprd_scrub_sector(osprd_info_t *d, unsigned sector)
+{
+	osprd_chunk_t *c;
+	unsigned offset = sector & (OSPRD_CHUNK_SECTORS - 1);
+	int generation;
+
+	osprd_io_begin(d);
+	if (sector < d->nsectors) {
+		c = &d->chunks[sector >> OSPRD_CHUNK_SHIFT];
+		// A chunk that is not zeroed yet has nothing to check
+		if (!c->zeroed)
+			goto out;
+		smp_rmb();
+		if (c->zpages) {
+			// Writes hold zlock.  A cold page is checked by the
+			// read that decompresses it.
+			osprd_zpage_t *zp = &c->zpages[offset / SECTORS_PER_PAGE];
+			spin_lock(&c->zlock);
+			if (zp->data
+			    && osprd_check_sectors(c, offset, 1, zp->data
+						   + (offset % SECTORS_PER_PAGE)
+						   * SECTOR_SIZE,
+						   atomic_read(&c->generation)) == 0)
+				osprd_crc_error(d, sector, &d->scrub_errors);
+			spin_unlock(&c->zlock);
+		} else {
+			generation = atomic_read(&c->generation);
+			smp_rmb();
+			if (atomic_read(&c->writers) == 0
+			    && osprd_check_sectors(c, offset, 1,
+						   c->data + offset * SECTOR_SIZE,
+						   generation) == 0)
+				osprd_crc_error(d, sector, &d->scrub_errors);
+		}
+		d->scrubbed++;
+	}
+ out:
+	osprd_io_end(d);
+}
+
+static int osprd_scrub(void *unused)
+{
+	unsigned sector;
+	int i;
+
+	while (!kthread_should_stop()) {
+		for (i = 0; i < NOSPRD; i++)
+			for (sector = 0; sector < osprds[i].nsectors
+				     && !kthread_should_stop(); sector++) {
+				// 'scrub_kbps' may change under us
+				int kbps;
+				while ((kbps = scrub_kbps) <= 0
+				       && !kthread_should_stop())
+					msleep_interruptible(1000);
+				osprd_scrub_sector(&osprds[i], sector);
+				if (sector % SCRUB_BATCH == SCRUB_BATCH - 1)
+					msleep_interruptible(SCRUB_BATCH * SECTOR_SIZE
+							     * 1000 / 1024
+							     / kbps + 1);
+			}
+		// Rest between passes over small devices
+		msleep_interruptible(1000);
+	}
+	return 0;
+}
+
+
+/*
+ * The compressor.
+ *
+ * With 'compress', a kernel thread looks at every page of every device once
+ * a second.  It compresses the pages nobody has touched for 'compress'
+ * seconds (see "Cold data compression" above).  A page that does not shrink
+ * by a quarter stays resident, and is not tried again until it is written.
+ */
+static struct task_struct *osprd_compressor;
+static z_stream osprd_deflater;		// The compressor's zlib state
+static u8 *osprd_zcopy;			// The page being compressed
+static u8 *osprd_zout;			// and its compressed form
+
+// Return 1 if the page at 'p' is all zeros.
+static int osprd_page_zero(const u8 *p)
+{
+	const unsigned long *q = (const unsigned long *) p;
+	int i;
+	for (i = 0; i < PAGE_SIZE / sizeof(long); i++)
+		if (q[i])
+			return 0;
+	return 1;
+}
+
+// Compress 'osprd_zcopy' into 'osprd_zout'.  Returns the compressed length,
+// or 0 if it would be longer than OSPRD_ZMAX.
+static int osprd_deflate(void)
+{
+	z_stream *s = &osprd_deflater;
+	if (zlib_deflateReset(s) != Z_OK)
+		return 0;
+	s->next_in = osprd_zcopy;
+	s->avail_in = PAGE_SIZE;
+	s->next_out = osprd_zout;
+	s->avail_out = OSPRD_ZMAX;
+	return zlib_deflate(s, Z_FINISH) == Z_STREAM_END ? s->total_out : 0;
+}
+
+// Compress page 'j' of chunk 'ci' of 'd' if it is cold.
+static void osprd_compress_page(osprd_info_t *d, unsigned ci, unsigned j)
+{
+	osprd_chunk_t *c;
+	osprd_zpage_t *zp;
+	unsigned long atime;
+	void *z = NULL;
+	int zlen = 0, zero;
+
+	osprd_io_begin(d);
+	if (ci >= d->nchunks || j >= osprd_chunk_pages(&d->chunks[ci])
+	    || !d->chunks[ci].zeroed)
+		goto out;
+	c = &d->chunks[ci];
+	zp = &c->zpages[j];
+
+	spin_lock(&c->zlock);
+	atime = zp->atime;
+	if (!zp->data || zp->incompressible
+	    || time_before(jiffies, atime + osprd_cold)) {
+		spin_unlock(&c->zlock);
+		goto out;
+	}
+	memcpy(osprd_zcopy, zp->data, PAGE_SIZE);
+	spin_unlock(&c->zlock);
+
+	if (!(zero = osprd_page_zero(osprd_zcopy))
+	    && (zlen = osprd_deflate()) > 0) {
+		if (!(z = kmalloc(zlen, GFP_ATOMIC | __GFP_NOWARN)))
+			goto out;
+		memcpy(z, osprd_zout, zlen);
+	}
+
+	// Any transfer since the copy moved 'atime' on
+	spin_lock(&c->zlock);
+	if (zp->data && zp->atime == atime) {
+		if (zero || z) {
+			mempool_free(virt_to_page(zp->data), osprd_page_pool);
+			zp->data = NULL;
+			zp->z = z;
+			zp->zlen = zlen;
+			z = NULL;
+		} else
+			zp->incompressible = 1;
+	}
+	spin_unlock(&c->zlock);
+ out:
+	osprd_io_end(d);
+	kfree(z);
+}
+
+static int osprd_compress(void *unused)
+{
+	unsigned ci, j;
+	int i;
+
+	while (!kthread_should_stop()) {
+		for (i = 0; i < NOSPRD; i++)
+			for (ci = 0; ci < osprds[i].nchunks
+				     && !kthread_should_stop(); ci++) {
+				for (j = 0; j < OSPRD_CHUNK_SECTORS / SECTORS_PER_PAGE; j++)
+					osprd_compress_page(&osprds[i], ci, j);
+				cond_resched();
+			}
+		msleep_interruptible(1000);
+	}
+	return 0;
+}
+
+// With 'compress', set up what compression and decompression need.
+static int osprd_compress_init(void)
+{
+	int cpu;
+
+	// Clamp first: 'compress * HZ' would overflow an int
+	osprd_cold = (unsigned long) min_t(unsigned, compress, OSPRD_COLD_MAX)
+		* HZ;
+	if (!(osprd_page_pool = mempool_create_page_pool(OSPRD_PAGE_RESERVE, 0))
+	    || !(osprd_zcopy = kmalloc(PAGE_SIZE, GFP_KERNEL))
+	    || !(osprd_zout = kmalloc(PAGE_SIZE, GFP_KERNEL))
+	    || !(osprd_deflater.workspace = vmalloc(zlib_deflate_workspacesize()))
+	    || zlib_deflateInit2(&osprd_deflater, Z_BEST_SPEED, Z_DEFLATED,
+				 -MAX_WBITS, DEF_MEM_LEVEL,
+				 Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+	for_each_possible_cpu(cpu)
+		if (!(osprd_inflate_ws[cpu] = vmalloc(zlib_inflate_workspacesize())))
+			return -1;
+	return 0;
+}
+
+static void osprd_compress_cleanup(void)
+{
+	int cpu;
+	for_each_possible_cpu(cpu)
+		if (osprd_inflate_ws[cpu])
+			vfree(osprd_inflate_ws[cpu]);
+	if (osprd_deflater.workspace)
+		vfree(osprd_deflater.workspace);
+	kfree(osprd_zout);
+	kfree(osprd_zcopy);
+	if (osprd_page_pool)
+		mempool_destroy(osprd_page_pool);
+}
+
+
+// This function is called when a /dev/osprdX file is opened.
+// You aren't likely to need to change this.
+static int osprd_open(struct inode *inode, struct file *filp)
+{
+	osprd_info_t *d = file2osprd(filp);
+
+	// Unless the device uses write-back caching, set the O_SYNC flag.
+	// That way, we will get writes immediately instead of waiting for
+	// them to get through write-back caches.
+	if (!d || !d->writeback)
+		filp->f_flags |= O_SYNC;
+	return 0;
+}
+
+/*
+ * Read lock bookkeeping.
+ *
+ * Normally a device counts its read locks in 'num_ReadLocks' and lists the
+ * readers' pids in 'read_list', both protected by 'd->mutex'.  With the
+ * 'brlock' module parameter, each CPU keeps its own count and list in a
+ * slot of 'd->readers' instead, so taking and releasing a read lock only
+ * touches the local CPU's cacheline.  Writers pay for this: to see whether
+ * any read locks are held, they add up the counts of every CPU.
+ */
+
+// Add the reader node 'node' to the front of the list '*list'.
+static void read_list_add(read_list_t *list, read_list_t node)
+{
+	node->next = *list;
+	*list = node;
+}
+
+// Remove the read lock held through 'filp' from the list '*list'.
+// Returns 1 if it was there.
+static int read_list_remove(read_list_t *list, struct file *filp)
+{
+	read_list_t del;
+	while (*list != NULL && (*list)->filp != filp)
+		list = &(*list)->next;
+	if (*list == NULL)
+		return 0;
+	del = *list;
+	*list = del->next;
+	kfree(del);
+	return 1;
+}
+
+// Return 1 if 'pid' is on the list 'list'.
+static int read_list_contains(read_list_t list, pid_t pid)
+{
+	for (; list != NULL; list = list->next)
+		if (list->reader == pid)
+			return 1;
+	return 0;
+}
+
+// Free every node on the list '*list'.
+static void read_list_free(read_list_t *list)
+{
+	while (*list != NULL) {
+		read_list_t del = *list;
+		*list = del->next;
+		kfree(del);
+	}
+}
+
+// Remove the read lock held through 'filp' from a CPU's reader slot.
+// Returns 1 if it was there.
+static int reader_slot_remove(osprd_reader_slot_t *slot, struct file *filp)
+{
+	int found;
+	osp_spin_lock(&slot->lock);
+	found = read_list_remove(&slot->read_list, filp);
+	if (found)
+		slot->count--;
+	osp_spin_unlock(&slot->lock);
+	return found;
+}
+
+/*
+ * osprd_add_reader(d, node)
+ *   Records a read lock held by the process 'node->reader' through
+ *   'node->filp', using the reader node 'node'.  The caller holds d->mutex,
+ *   and may be handing the lock to another process.
+ */
+static void osprd_add_reader(osprd_info_t *d, read_list_t node)
+{
+	node->expires = jiffies + d->lease;
+	if (d->readers) {
+		osprd_reader_slot_t *slot = per_cpu_ptr(d->readers, get_cpu());
+		osp_spin_lock(&slot->lock);
+		read_list_add(&slot->read_list, node);
+		slot->count++;
+		osp_spin_unlock(&slot->lock);
+		put_cpu();
+	} else {
+		read_list_add(&d->read_list, node);
+		d->num_ReadLocks++;
+	}
+}
+
+/*
+ * osprd_remove_reader(d, filp)
+ *   Forgets the read lock held through 'filp'.  Returns 1 if there was one.
+ *   Without 'brlock', the caller holds d->mutex.
+ */
+static int osprd_remove_reader(osprd_info_t *d, struct file *filp)
+{
+	if (d->readers) {
+		// The lock was most likely taken on this CPU
+		int cpu, here = get_cpu();
+		int found = reader_slot_remove(per_cpu_ptr(d->readers, here), filp);
+		for_each_possible_cpu(cpu)
+			if (!found && cpu != here)
+				found = reader_slot_remove(per_cpu_ptr(d->readers, cpu), filp);
+		put_cpu();
+		return found;
+	} else if (read_list_remove(&d->read_list, filp)) {
+		d->num_ReadLocks--;
+		return 1;
+	} else
+		return 0;
+}
+
+/*
+ * osprd_num_readers(d)
+ *   Returns the number of read locks held on 'd'.  The caller holds
+ *   d->mutex.
+ */
+static int osprd_num_readers(osprd_info_t *d)
+{
+	int cpu, n = 0;
+	if (!d->readers)
+		return d->num_ReadLocks;
+	for_each_possible_cpu(cpu)
+		n += per_cpu_ptr(d->readers, cpu)->count;
+	return n;
+}
+
+/*
+ * osprd_is_reader(d, pid)
+ *   Returns 1 if 'pid' holds a read lock on 'd'.  The caller holds d->mutex.
+ */
+static int osprd_is_reader(osprd_info_t *d, pid_t pid)
+{
+	int cpu, found = 0;
+	if (!d->readers)
+		return read_list_contains(d->read_list, pid);
+	for_each_possible_cpu(cpu) {
+		osprd_reader_slot_t *slot = per_cpu_ptr(d->readers, cpu);
+		osp_spin_lock(&slot->lock);
+		found = found || read_list_contains(slot->read_list, pid);
+		osp_spin_unlock(&slot->lock);
+	}
+	return found;
+}
+
+/*
+ * osprd_fast_read_lock(d, node)
+ *   With 'brlock', tries to take a read lock without touching d->mutex.
+ *   This works whenever no writer holds or waits for the lock and nobody
+ *   is queued.  Returns 1 on success; otherwise the caller must take the
+ *   read lock the slow way.
+ */
+static int osprd_fast_read_lock(osprd_info_t *d, read_list_t node)
+{
+	osprd_reader_slot_t *slot = per_cpu_ptr(d->readers, get_cpu());
+	osp_spin_lock(&slot->lock);
+	slot->count++;
+	// Pairs with the barrier after a writer bumps d->writers: either the
+	// writer sees our count, or we see the writer.
+	smp_mb();
+	if (d->writers == 0 && d->ticket_head == d->ticket_tail) {
+		node->reader = current->pid;
+		node->expires = jiffies + d->lease;
+		read_list_add(&slot->read_list, node);
+		osp_spin_unlock(&slot->lock);
+		put_cpu();
+		return 1;
+	}
+	slot->count--;
+	osp_spin_unlock(&slot->lock);
+	put_cpu();
+	// A writer may have seen our count and gone to sleep
+	wake_up_all(&d->blockq);
+	return 0;
+}
+
+/*
+ * Lock leases.
+ *
+ * When 'd->lease' is nonzero, a lock expires that long after it was granted
+ * or last renewed with OSPRDIOCRENEW.  Nothing happens right when a lease
+ * runs out.  Instead, processes that wait for the lock or try to take it
+ * revoke expired locks, so a holder that hangs without closing its file
+ * cannot stall the queue forever.  The holder's record moves to
+ * d->revoked, and its file keeps F_OSPRD_LOCKED: only the holder changes
+ * its own f_flags.  The holder finds out on its next read, write,
+ * OSPRDIOCRW, or release, which fail with -ENOLCK.
+ *
+ * Revocation is advisory.  The check happens in the read and write file
+ * operations, not in the request path, where a bio no longer says which
+ * file it came from.  A revoked holder can still reach the device through
+ * mmap, readv and writev, or asynchronous I/O, and write-back of its dirty
+ * pages still goes through.
+ */
+
+// Move the expired read locks on the list '*list' to 'd->revoked'.
+// Returns how many there were.
+static int read_list_reap(osprd_info_t *d, read_list_t *list)
+{
+	int n = 0;
+	while (*list != NULL)
+		if (time_after(jiffies, (*list)->expires)) {
+			read_list_t del = *list;
+			*list = del->next;
+			read_list_add(&d->revoked, del);
+			n++;
+		} else
+			list = &(*list)->next;
+	return n;
+}
+
+static int osprd_is_revoked(osprd_info_t *d, struct file *filp)
+{
+	read_list_t node;
+	int found = 0;
+
+	// Files that hold no lock, and devices with no revoked locks, are
+	// the common case and need no lock
+	if (!(filp->f_flags & F_OSPRD_LOCKED) || d->revoked == NULL)
+		return 0;
+	osp_spin_lock(&d->mutex);
+	for (node = d->revoked; node != NULL && !found; node = node->next)
+		found = (node->filp == filp);
+	osp_spin_unlock(&d->mutex);
+	return found;
+}
+
+// Forget that the lock held through 'filp' was revoked.  Returns 1 if it
+// was.
+static int osprd_forget_revoked(osprd_info_t *d, struct file *filp)
+{
+	int found;
+	osp_spin_lock(&d->mutex);
+	found = read_list_remove(&d->revoked, filp);
+	osp_spin_unlock(&d->mutex);
+	return found;
+}
+
+// Restart the leases of the read locks on 'list' held through 'filp', or of
+// all of them if 'filp' is NULL.  Returns how many there were.
+static int read_list_renew(read_list_t list, struct file *filp,
+			   unsigned long expires)
+{
+	int n = 0;
+	for (; list != NULL; list = list->next)
+		if (!filp || list->filp == filp) {
+			list->expires = expires;
+			n++;
+		}
+	return n;
+}
+
+/*
+ * osprd_reap_leases(d)
+ *   Revokes every lock on 'd' whose lease has run out.  Returns 1 if it
+ *   revoked any, in which case the caller should hand the lock on with
+ *   osprd_handoff().
+ *   The caller holds d->mutex.
+ */
+static int osprd_reap_leases(osprd_info_t *d)
+{
+	int cpu, n = 0;
+
+	if (!d->lease)
+		return 0;
+	if (d->ramdisk_WriteLocked && time_after(jiffies, d->write_expires))
+	{
+		eprintk("osprd: revoking expired write lock of pid %d\n",
+			d->pid_holdingWriteLock);
+		read_list_add(&d->revoked, d->write_node);
+		d->ramdisk_WriteLocked=0;
+		d->pid_holdingWriteLock=-1;
+		d->write_node = NULL;
+		d->writers--;
+		d->read_phase_end = d->ticket_head;
+		osprd_trace(OSPRD_TRACE_LOCK, d, "revoke write");
+		n++;
+	}
+	if (d->readers) {
+		for_each_possible_cpu(cpu) {
+			osprd_reader_slot_t *slot = per_cpu_ptr(d->readers, cpu);
+			int k;
+			osp_spin_lock(&slot->lock);
+			k = read_list_reap(d, &slot->read_list);
+			slot->count -= k;
+			osp_spin_unlock(&slot->lock);
+			n += k;
+		}
+	} else {
+		int k = read_list_reap(d, &d->read_list);
+		d->num_ReadLocks -= k;
+		n += k;
+	}
+	if (n > 0)
+		osprd_trace(OSPRD_TRACE_LOCK, d, "revoke %d", n);
+	return n > 0;
+}
+
+// Restart the leases of the read locks held through 'filp', or of all read
+// locks if 'filp' is NULL.  Returns how many there were.  The caller holds
+// d->mutex.
+static int osprd_renew_readers(osprd_info_t *d, struct file *filp)
+{
+	unsigned long expires = jiffies + d->lease;
+	int cpu, n = 0;
+
+	if (!d->readers)
+		return read_list_renew(d->read_list, filp, expires);
+	for_each_possible_cpu(cpu) {
+		osprd_reader_slot_t *slot = per_cpu_ptr(d->readers, cpu);
+		osp_spin_lock(&slot->lock);
+		n += read_list_renew(slot->read_list, filp, expires);
+		osp_spin_unlock(&slot->lock);
+	}
+	return n;
+}
+
+/*
+ * osprd_renew(d, filp)
+ *   Restarts the lease of the lock held through 'filp'.  Returns 0,
+ *   -ENOLCK if the lock was already revoked, or -EINVAL if 'filp' does not
+ *   hold a lock.
+ */
+static int osprd_renew(osprd_info_t *d, struct file *filp)
+{
+	int found;
+
+	if (!(filp->f_flags & F_OSPRD_LOCKED))
+		return -EINVAL;
+
+	osp_spin_lock(&d->mutex);
+	if (filp->f_mode & FMODE_WRITE)
+	{
+		found = (d->ramdisk_WriteLocked && d->write_node->filp == filp);
+		if (found)
+			d->write_expires = jiffies + d->lease;
+	}
+	else
+		found = osprd_renew_readers(d, filp);
+	osp_spin_unlock(&d->mutex);
+	return found ? 0 : -ENOLCK;
+}
+
+/*
+ * osprd_set_lease(d, ms)
+ *   Sets the lock lease of 'd' to 'ms' milliseconds (0 for none).  The
+ *   leases of locks held now start over.  A short lease revokes other
+ *   processes' locks, so this needs CAP_SYS_ADMIN.
+ */
+static int osprd_set_lease(osprd_info_t *d, unsigned long ms)
+{
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	osp_spin_lock(&d->mutex);
+	d->lease = msecs_to_jiffies(ms);
+	d->write_expires = jiffies + d->lease;
+	osprd_renew_readers(d, NULL);
+	osp_spin_unlock(&d->mutex);
+	return 0;
+}
+
+/*
+ * Lock scheduling.
+ *
+ * Every blocking lock request takes a ticket and waits on 'd->wait_list',
+ * which is kept in ticket order, until the device's policy lets it have
+ * the lock:
+ *
+ * OSPRD_POLICY_FIFO	  Strictly in ticket order.
+ * OSPRD_POLICY_READERS	  Readers may pass queued writers, but only
+ *			  'policy_bypass' times before a writer gets in.
+ * OSPRD_POLICY_WRITERS	  Writers pass queued readers; readers wait until
+ *			  no writer is queued.
+ * OSPRD_POLICY_PHASEFAIR Read and write phases alternate: when a writer
+ *			  releases the lock, every reader queued by then gets
+ *			  in before the next writer, and readers that queue
+ *			  behind a writer wait for it.
+ *
+ * A ticket served out of order goes on the dead ticket list, like the
+ * ticket of a request abandoned after a signal, so 'ticket_tail' can skip
+ * it later.
+ *
+ * Whoever releases the lock, or otherwise changes who may have it, grants
+ * it to the waiters that may go next on their behalf (osprd_handoff()).
+ * Woken waiters already own the lock and need not look at the device.
+ */
+
+// Advance 'ticket_tail' past tickets that were abandoned or served out of
+// order.  The caller holds d->mutex.
+static void osprd_skip_dead_tickets(osprd_info_t *d)
+{
+	while(d->dead_tix != NULL)
+	{
+		if (d->dead_tix->ticket == d->ticket_tail)
+		{
+			dead_tix_t del = d->dead_tix;
+			d->dead_tix = d->dead_tix->next;
+			kfree(del);
+		}
+		else // not in head (must be greater than 1 element)
+		{
+			dead_tix_t itr = d->dead_tix;
+			while(itr->next != NULL && itr->next->ticket != d->ticket_tail)
+				itr = itr->next;
+
+			if (itr->next != NULL)
+			{
+				dead_tix_t del = itr->next;
+				itr->next = del->next;
+				kfree(del);
+			}
+			else
+				break;;
+		}
+		d->ticket_tail++;
+	}
+}
+
+// Retire the ticket of the waiter 'w' once its request is served or
+// abandoned.  A ticket retired out of order goes on the dead ticket list in
+// 'w->dead', so nothing is allocated under the spinlock.  The caller holds
+// d->mutex.
+static void osprd_retire_ticket(osprd_info_t *d, wait_list_t w)
+{
+	if (w->ticket == d->ticket_tail)
+		d->ticket_tail++;
+	else
+	{
+		dead_tix_t new = w->dead;
+		w->dead = NULL;
+		new->ticket = w->ticket;
+		new->next = d->dead_tix;
+		d->dead_tix = new;
+	}
+	osprd_skip_dead_tickets(d);
+}
+
+// Return 1 if ticket 'a' was issued before ticket 'b'.
+static inline int ticket_before(unsigned a, unsigned b)
+{
+	return (int) (a - b) < 0;
+}
+
+// Add the waiter 'w' to the end of the device's wait list.
+static void wait_list_append(osprd_info_t *d, wait_list_t w)
+{
+	wait_list_t *itr = &d->wait_list;
+	while (*itr != NULL)
+		itr = &(*itr)->next;
+	w->next = NULL;
+	*itr = w;
+}
+
+// Remove the waiter 'w' from the device's wait list.
+static void wait_list_remove(osprd_info_t *d, wait_list_t w)
+{
+	wait_list_t *itr = &d->wait_list;
+	while (*itr != NULL && *itr != w)
+		itr = &(*itr)->next;
+	if (*itr != NULL)
+		*itr = w->next;
+}
+
+// Return 1 if a writer queued before the waiter 'w' is still waiting.
+static int osprd_writer_ahead(osprd_info_t *d, wait_list_t w)
+{
+	wait_list_t itr;
+	for (itr = d->wait_list; itr != NULL; itr = itr->next)
+		if (itr != w && !ticket_before(itr->ticket, w->ticket))
+			break;
+		else if (itr != w && itr->dir == WRITE)
+			return 1;
+	return 0;
+}
+
+// Return 1 if a reader admitted to the current read phase still waits.
+static int osprd_phase_reader_waiting(osprd_info_t *d)
+{
+	wait_list_t itr;
+	for (itr = d->wait_list; itr != NULL; itr = itr->next)
+		if (itr->dir == READ && ticket_before(itr->ticket, d->read_phase_end))
+			return 1;
+	return 0;
+}
+
+/*
+ * osprd_may_grant(d, w)
+ *   Returns 1 if the device's policy lets the waiter 'w' have the lock now.
+ *   The caller holds d->mutex.
+ */
+static int osprd_may_grant(osprd_info_t *d, wait_list_t w)
+{
+	int first = (w->ticket == d->ticket_tail);
+
+	//no one else may hold a write lock, and a writer needs no readers either
+	if (d->ramdisk_WriteLocked
+	    || (w->dir == WRITE && osprd_num_readers(d) != 0))
+		return 0;
+
+	switch (d->policy) {
+	case OSPRD_POLICY_READERS:
+		if (w->dir == READ)
+			return first || !osprd_writer_ahead(d, w)
+				|| d->bypassed < policy_bypass;
+		return first;
+	case OSPRD_POLICY_WRITERS:
+		if (w->dir == READ)
+			return first && d->writers == 0;
+		return !osprd_writer_ahead(d, w);
+	case OSPRD_POLICY_PHASEFAIR:
+		if (w->dir == READ)
+			return !osprd_writer_ahead(d, w)
+				|| ticket_before(w->ticket, d->read_phase_end);
+		return !osprd_writer_ahead(d, w)
+			&& !osprd_phase_reader_waiting(d);
+	default:
+		return first;
+	}
+}
+
+/*
+ * osprd_grant(d, w)
+ *   Gives the lock to the waiter 'w' and retires its ticket.  'w' must not
+ *   be on the wait list.  The caller holds d->mutex.
+ */
+static void osprd_grant(osprd_info_t *d, wait_list_t w)
+{
+	if (w->dir == WRITE)
+	{
+		//allow the process to have the write lock and update struct values
+		d->ramdisk_WriteLocked=1;
+		d->pid_holdingWriteLock = w->pid;
+		d->write_node = w->node;
+		d->write_expires = jiffies + d->lease;
+		d->bypassed = 0;
+	}
+	else
+	{
+		if (osprd_writer_ahead(d, w))
+			d->bypassed++;
+		//add the pid to linked list of pids with read locks
+		osprd_add_reader(d, w->node);
+	}
+	osprd_trace(OSPRD_TRACE_LOCK, d, "grant %s ticket %u waited %u ms",
+		    w->dir == WRITE ? "write" : "read", w->ticket,
+		    jiffies_to_msecs(jiffies - w->since));
+	osprd_retire_ticket(d, w);
+}
+
+/*
+ * osprd_handoff(d)
+ *   Hands the lock directly to every waiter the policy lets have it now,
+ *   in ticket order, and wakes just those tasks.  The lock is theirs
+ *   before they run, so a trylocker cannot slip in first, and they return
+ *   from osprd_acquire() without taking d->mutex again.  Returns the
+ *   number of waiters granted.  The caller holds d->mutex.
+ */
+static int osprd_handoff(osprd_info_t *d)
+{
+	wait_list_t *itr = &d->wait_list;
+	int n = 0;
+
+	osprd_skip_dead_tickets(d);
+	while (*itr != NULL)
+	{
+		wait_list_t w = *itr;
+		struct task_struct *task = w->task;
+		if (!osprd_may_grant(d, w))
+		{
+			itr = &w->next;
+			continue;
+		}
+		*itr = w->next;
+		osprd_grant(d, w);
+		// 'w' is on the waiter's stack; once it sees 'granted' it may
+		// return, so hold on to its task to wake it
+		get_task_struct(task);
+		smp_wmb();
+		w->granted = 1;
+		wake_up_process(task);
+		put_task_struct(task);
+		n++;
+	}
+	return n;
+}
+
+static int osprd_wake_cond(osprd_info_t *d, wait_list_t w)
+{
+	int r;
+
+	// Handed the lock by osprd_handoff(): there is nothing to check
+	if (w->granted)
+	{
+		smp_rmb();
+		return 1;
+	}
+
+	osp_spin_lock(&d->mutex);
+	r = w->granted;
+	if (!r)
+	{
+		osprd_skip_dead_tickets(d);
+		r = osprd_may_grant(d, w);
+		if (r)
+		{
+			wait_list_remove(d, w);
+			osprd_grant(d, w);
+			w->granted = 1;
+			// The tickets behind ours may be able to go now too
+			osprd_handoff(d);
+		}
+	}
+	osp_spin_unlock(&d->mutex);
+	//eprintk("PID %d COND VALUE: %d\n", current->pid, r);
+	return r;
+}
+
+// Give up on the waiter 'w' after a signal.  Its ticket goes on the dead
+// ticket list so the tickets behind it are not stuck.  Returns 1, and gives
+// up nothing, if the lock was handed to 'w' in the meantime.
+static int osprd_abandon_ticket(osprd_info_t *d, wait_list_t w)
+{
+	osp_spin_lock(&d->mutex);
+	if (w->granted)
+	{
+		osp_spin_unlock(&d->mutex);
+		return 1;
+	}
+	osprd_trace(OSPRD_TRACE_LOCK, d, "abandon ticket %u", w->ticket);
+	wait_list_remove(d, w);
+	osprd_retire_ticket(d, w);
+	if (w->dir == WRITE)
+		d->writers--;
+	d->abandoned++;
+	osprd_handoff(d);
+	osp_spin_unlock(&d->mutex);
+	return 0;
+}
+
+/*
+ * osprd_acquire(d, filp, block)
+ *   Locks 'd' through 'filp': for writing if 'filp' is writable, otherwise
+ *   for reading.  Waits until the device's policy grants the lock, or, if
+ *   'block' is 0, returns -EBUSY instead of waiting.  Returns 0 once the
+ *   lock is held, -EDEADLK if the process already holds a conflicting lock,
+ *   or -ERESTARTSYS if a signal arrived while it waited.  Locks whose leases
+ *   run out in the meantime are revoked.
+ */
+static int osprd_acquire(osprd_info_t *d, struct file *filp, int block)
+{
+	int filp_writable = (filp->f_mode & FMODE_WRITE) != 0;
+	wait_list_node w;
+	long r;
+
+	// Locking again forgets that an earlier lock was revoked
+	if (osprd_forget_revoked(d, filp))
+		filp->f_flags &= ~F_OSPRD_LOCKED;
+
+	w.dir = filp_writable ? WRITE : READ;
+	w.pid = current->pid;
+	w.filp = filp;
+	w.task = current;
+	w.granted = 0;
+	// Allocate the holder's list node while we can sleep
+	if (!(w.node = kmalloc(sizeof(read_list_node), GFP_KERNEL)))
+		return -ENOMEM;
+	w.node->reader = current->pid;
+	w.node->filp = filp;
+	if (!filp_writable && d->readers && osprd_fast_read_lock(d, w.node))
+	{
+		osprd_trace(OSPRD_TRACE_LOCK, d, "grant read fast");
+		filp->f_flags |= F_OSPRD_LOCKED;
+		return 0;
+	}
+	if (!(w.dead = kmalloc(sizeof(dead_tix_node), GFP_KERNEL)))
+	{
+		kfree(w.node);
+		return -ENOMEM;
+	}
+
+	osp_spin_lock(&d->mutex);
+	//Since process wants lock, ensure process doesn't already have write lock or else you will block current process and therefore it can never release lock
+	if (current->pid == d->pid_holdingWriteLock
+	    //muust iterate thorugh all read_lock pids and ensure you haven't read locked the ramdisk already or deadlock!
+	    || (filp_writable && osprd_is_reader(d, current->pid)))
+	{
+		osp_spin_unlock(&d->mutex);
+		kfree(w.node);
+		kfree(w.dead);
+		return -EDEADLK;
+	}
+
+	//Critical Section surrounding getting and incrementing ticket_head
+	w.ticket = d->ticket_head++;
+	w.since = jiffies;
+	osprd_trace(OSPRD_TRACE_LOCK, d, "ticket %u %s", w.ticket,
+		    filp_writable ? "write" : "read");
+	if (filp_writable)
+	{
+		// Keep fast-path readers out from now on
+		d->writers++;
+		smp_mb();
+	}
+
+	osprd_skip_dead_tickets(d);
+	if (osprd_reap_leases(d))
+		osprd_handoff(d);
+	if (osprd_may_grant(d, &w))
+	{
+		osprd_grant(d, &w);
+		osp_spin_unlock(&d->mutex);
+		kfree(w.dead);
+		filp->f_flags |= F_OSPRD_LOCKED;
+		return 0;
+	}
+	else if (!block)
+	{
+		// Hand the ticket back; nobody has taken one since
+		osprd_trace(OSPRD_TRACE_LOCK, d, "busy ticket %u", w.ticket);
+		d->ticket_head--;
+		if (filp_writable)
+			d->writers--;
+		osp_spin_unlock(&d->mutex);
+		kfree(w.node);
+		kfree(w.dead);
+		return -EBUSY;
+	}
+	wait_list_append(d, &w);
+	osprd_trace(OSPRD_TRACE_LOCK, d, "wait ticket %u", w.ticket);
+	osp_spin_unlock(&d->mutex);
+
+	//block current process until the policy lets it have the lock,
+	//revoking expired locks every time a lease's length goes by
+	for (;;) {
+		r = wait_event_interruptible_timeout(d->blockq,
+				osprd_wake_cond(d, &w),
+				d->lease ? (long) d->lease : MAX_SCHEDULE_TIMEOUT);
+		if (r != 0)
+			break;
+		osp_spin_lock(&d->mutex);
+		if (osprd_reap_leases(d))
+			osprd_handoff(d);
+		osp_spin_unlock(&d->mutex);
+	}
+	// A signal that arrives as the lock is handed over loses the race;
+	// the caller gets the lock and then the signal
+	if (r == -ERESTARTSYS && !osprd_abandon_ticket(d, &w))
+	{
+		kfree(w.node);
+		kfree(w.dead);
+		return -ERESTARTSYS;
+	}
+	kfree(w.dead);
+	// osprd_grant() leaves our f_flags to us
+	filp->f_flags |= F_OSPRD_LOCKED;
+	return 0;
+}
+
+/*
+ * osprd_set_policy(d, policy)
+ *   Switches 'd' to the lock scheduling policy 'policy'.  A policy can
+ *   starve other processes' requests, so this needs CAP_SYS_ADMIN.
+ */
+static int osprd_set_policy(osprd_info_t *d, unsigned long policy)
+{
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (policy > OSPRD_POLICY_PHASEFAIR)
+		return -EINVAL;
+	osp_spin_lock(&d->mutex);
+	d->policy = policy;
+	d->bypassed = 0;
+	d->read_phase_end = d->ticket_tail;
+	// Waiters may be able to go under the new policy
+	osprd_handoff(d);
+	osp_spin_unlock(&d->mutex);
+	return 0;
+}
+
+/*
+ * osprd_query(d, arg)
+ *   Copies a snapshot of the lock state of 'd' to the struct
+ *   osprd_lockstate at 'arg'.  Everything but the count of 'brlock' fast
+ *   path readers is read under d->mutex, so the snapshot is consistent.
+ *   Never blocks on the lock itself.
+ */
+static int osprd_query(osprd_info_t *d, struct osprd_lockstate __user *arg)
+{
+	struct osprd_lockstate state;
+	wait_list_t w;
+	dead_tix_t t;
+
+	memset(&state, 0, sizeof(state));
+	osp_spin_lock(&d->mutex);
+	state.write_locked = d->ramdisk_WriteLocked;
+	state.readers = osprd_num_readers(d);
+	state.queued = d->ticket_head - d->ticket_tail;
+	for (w = d->wait_list; w != NULL; w = w->next)
+		state.waiters++;
+	// The wait list is in ticket order, so its head has waited longest
+	if (d->wait_list != NULL)
+		state.oldest_wait_ms = jiffies_to_msecs(jiffies - d->wait_list->since);
+	for (t = d->dead_tix; t != NULL; t = t->next)
+		state.dead++;
+	state.abandoned = d->abandoned;
+	osp_spin_unlock(&d->mutex);
+
+	return copy_to_user(arg, &state, sizeof(state)) ? -EFAULT : 0;
+}
+
+/*
+ * osprd_unlock(d, filp)
+ *   Releases the lock held through 'filp' and wakes up blocked processes.
+ *   Returns 0, -ENOLCK if the lock was revoked because its lease ran out,
+ *   or -EINVAL if 'filp' does not hold a lock.
+ */
+static int osprd_unlock(osprd_info_t *d, struct file *filp)
+{
+	if (!(filp->f_flags & F_OSPRD_LOCKED))
+		return -EINVAL;
+	if (osprd_is_revoked(d, filp))
+	{
+		filp->f_flags &= ~F_OSPRD_LOCKED;
+		goto revoked;
+	}
+
+	// Writes still in the page cache must reach the device before anyone
+	// else can lock it
+	if ((filp->f_mode & FMODE_WRITE) && !(filp->f_flags & O_SYNC))
+		filemap_write_and_wait(filp->f_mapping);
+	filp->f_flags &= ~F_OSPRD_LOCKED;
+
+	if (filp->f_mode & FMODE_WRITE)
+	{
+		osp_spin_lock(&d->mutex);
+		if (d->write_node == NULL || d->write_node->filp != filp)
+		{
+			// Revoked while we got here
+			osp_spin_unlock(&d->mutex);
+			goto revoked;
+		}
+		d->ramdisk_WriteLocked=0;
+		d->pid_holdingWriteLock=-1; //ensure no process holds write lock
+		kfree(d->write_node);
+		d->write_node = NULL;
+		d->writers--;
+		// Readers queued by now make up the next read phase
+		d->read_phase_end = d->ticket_head;
+		osprd_trace(OSPRD_TRACE_LOCK, d, "release write");
+		osprd_handoff(d);
+		osp_spin_unlock(&d->mutex);
+	}
+	else if (d->readers)
+	{
+		if (!osprd_remove_reader(d, filp))
+			goto revoked;
+		osprd_trace(OSPRD_TRACE_LOCK, d, "release read");
+		// Only hand off if somebody could be waiting, so releasing an
+		// uncontended read lock stays on this CPU
+		smp_mb();
+		if (d->writers == 0 && d->ticket_head == d->ticket_tail)
+			return 0;
+		osp_spin_lock(&d->mutex);
+		osprd_handoff(d);
+		osp_spin_unlock(&d->mutex);
+	}
+	else
+	{
+		int found;
+		osp_spin_lock(&d->mutex);
+		found = osprd_remove_reader(d, filp);
+		if (found)
+		{
+			osprd_trace(OSPRD_TRACE_LOCK, d, "release read");
+			osprd_handoff(d);
+		}
+		osp_spin_unlock(&d->mutex);
+		if (!found)
+			goto revoked;
+	}
+	return 0;
+
+ revoked:
+	osprd_forget_revoked(d, filp);
+	return -ENOLCK;
+}
+
+// This function is called when a /dev/osprdX file is finally closed.
+// (If the file descriptor was dup2ed, this function is called only when the
+// last copy is closed.)
+static int osprd_close_last(struct inode *inode, struct file *filp)
+{
+	if (filp) {
+		osprd_info_t *d = file2osprd(filp);
+
+		// EXERCISE: If the user closes a ramdisk file that holds
+		// a lock, release the lock.  Also wake up blocked processes
+		// as appropriate.
+
+		// Your code here.
+		return osprd_unlock(d, filp);
 	}
 
 	return 0;
@@ -320,7 +2633,7 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 
 	// Set 'r' to the ioctl's return value: 0 on success, negative on error
 
-	if (cmd == OSPRDIOCACQUIRE) 
+	if (cmd == OSPRDIOCACQUIRE)
     {
 
 		// EXERCISE: Lock the ramdisk.
@@ -361,123 +2674,11 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 		// Your code here (instead of the next two lines).
 		//eprintk("Attempting to acquire\n");
 		//r = -ENOTTY;
-        
 
-		osp_spin_lock(&d->mutex);
-        //Since process wants lock, ensure process doesn't already have write lock or else you will block current process and therefore it can never release lock
-        if (current->pid == d->pid_holdingWriteLock)
-		{
-			osp_spin_unlock(&d->mutex);
-            return -EDEADLK;
-		}
-        if (filp_writable)
-		{
-			//muust iterate thorugh all read_lock pids and ensure you haven't read locked the ramdisk already or deadlock! (NEEDS TO BE DONE)
-            read_list_t itr = d->read_list;
-			while(itr != NULL)
-			{
-				if (itr->reader == current->pid)
-				{
-					osp_spin_unlock(&d->mutex);
-					return -EDEADLK;
-				}
-				itr = itr->next;
-			}
-		}
-		osp_spin_unlock(&d->mutex);
-		
-        //Critical Section surrounding getting and incrementing ticket_head
-        osp_spin_lock(&d->mutex);
-        unsigned localTicket = d->ticket_head;
-        d->ticket_head++;
-        osp_spin_unlock(&d->mutex);
-        
-        //check if file is open for writing and process desires write lock
-        if (filp_writable)
-        {
-		    osp_spin_lock(&d->mutex);
-
-            //can only get writing lock if no other processes have writing or reading lock and you are holding the correct ticket
-            if (d->num_ReadLocks!=0 || d->ramdisk_WriteLocked || d->ticket_tail!=localTicket)
-            {
-                //block current process until above is false and current process holds the next ticket!
-                osp_spin_unlock(&d->mutex);
-                int w_e_i_retValue = wait_event_interruptible(d->blockq, osprd_wake_cond(d, WRITE, localTicket));
-                if (w_e_i_retValue == -ERESTARTSYS) 
-				{
-					//eprintk("PROCESS %d RECEIVED SIGNAL\n", current->pid);
-					osp_spin_lock(&d->mutex);
-					dead_tix_t new = kmalloc(sizeof(dead_tix_node), GFP_ATOMIC);
-					new->ticket = localTicket;
-					new->next = d->dead_tix;
-					d->dead_tix = new;
-					osp_spin_unlock(&d->mutex);
-					return -ERESTARTSYS;
-				}
-                osp_spin_lock(&d->mutex);
-            }
-            
-            //allow current process to have the write lock and update struct values
-            d->ramdisk_WriteLocked=1;
-            d->pid_holdingWriteLock = current->pid;
-			//eprintk("PID %d WRITE LOCK\n", current->pid);
-            filp->f_flags |= F_OSPRD_LOCKED;
-            osp_spin_unlock(&d->mutex);
-        
-        }
-        else //file is opened for reading
-        {
-            osp_spin_lock(&d->mutex);
-             //We already checked if current process has a write lock; now block current process if someone else has a write lock on ramdisk
-            if (d->ramdisk_WriteLocked || d->ticket_tail!=localTicket)
-            {
-                osp_spin_unlock(&d->mutex);
-                //block current Process until above is false
-                int w_e_i_retValue = wait_event_interruptible(d->blockq, osprd_wake_cond(d, READ, localTicket));
-                if (w_e_i_retValue == -ERESTARTSYS) 
-				{
-					//eprintk("PROCESS %d RECEIVED SIGNAL\n", current->pid);
-					osp_spin_lock(&d->mutex);
-					dead_tix_t new = kmalloc(sizeof(dead_tix_node), GFP_ATOMIC);
-					new->ticket = localTicket;
-					new->next = d->dead_tix;
-					d->dead_tix = new;
-					osp_spin_unlock(&d->mutex);
-					return -ERESTARTSYS;
-				}
-                osp_spin_lock(&d->mutex);
-            }
-            
-            //process can get a read lock on the ramdisk
-            d->num_ReadLocks++;
-            filp->f_flags |= F_OSPRD_LOCKED;
-			//eprintk("PID %d READ LOCK\n", current->pid);
-            
-            //add current pid to linked list of pids with read locks
-            if (d->read_list == NULL)
-			{
-				read_list_t new = kmalloc(sizeof(read_list_node), GFP_ATOMIC);
-				new->reader = current->pid;
-				new->next = NULL;
-				d->read_list = new;
-			}
-			else
-			{
-				read_list_t new = kmalloc(sizeof(read_list_node), GFP_ATOMIC);
-				new->reader = current->pid;
-				new->next = d->read_list;
-				d->read_list = new;
-			}
-            osp_spin_unlock(&d->mutex);
-        
-        }
-        osp_spin_lock(&d->mutex);
-        d->ticket_tail++;
-        osp_spin_unlock(&d->mutex);
-        
-	} 
-    
-    else if (cmd == OSPRDIOCTRYACQUIRE) 
+		r = osprd_acquire(d, filp, 1);
+	}
+
+    else if (cmd == OSPRDIOCTRYACQUIRE)
     {
 
 		// EXERCISE: ATTEMPT to lock the ramdisk.
@@ -490,83 +2691,11 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 		// Your code here (instead of the next two lines).
 		//eprintk("Attempting to try acquire\n");
 		//r = -ENOTTY;
-        
-        //Since process wants lock, ensure process doesn't already have write lock or else you will block current process and therefore it can never release lock
-        if (current->pid == d->pid_holdingWriteLock)
-            return -EDEADLK;
-        
-        
-        //check if file is open for writing and process desires write lock
-        if (filp_writable)
-        {
-		    osp_spin_lock(&d->mutex);
-            //muust iterate thorugh all read_lock pids and ensure you haven't locked the ramdisk already or deadlock!
-            read_list_t itr = d->read_list;
-			while(itr != NULL)
-			{
-				if (itr->reader == current->pid)
-				{
-					osp_spin_unlock(&d->mutex);
-					return -EDEADLK;
-				}
-				itr = itr->next;
-			}
 
-            //can only get writing lock if no other processes have writing or reading lock
-            if (d->num_ReadLocks!=0 || d->ramdisk_WriteLocked || d->ticket_head!=d->ticket_tail)
-            {
-                //CANNOT ACQUIRE LOCK
-                osp_spin_unlock(&d->mutex);
-                return -EBUSY;
-            }
-            
-            //allow current process to have the write lock and update struct values
-            d->ramdisk_WriteLocked=1;
-            d->pid_holdingWriteLock = current->pid;
-			
-            filp->f_flags |= F_OSPRD_LOCKED;
-            osp_spin_unlock(&d->mutex);
-            
-        }
-        else //file is opened for reading
-        {
-            //WHAT IF ALREADY HAVE READ LOCK?!?!??!
-            //lets assume we don't need to take care of that case
-            
-            //We already checked if current process has a write lock; now ensure no one else has write lock
-            osp_spin_lock(&d->mutex);
-            if (d->ramdisk_WriteLocked || d->ticket_head!=d->ticket_tail)
-            {
-                osp_spin_unlock(&d->mutex);
-                return -EBUSY;
-            }
-            
-            //process can get a read lock on the ramdisk
-            d->num_ReadLocks++;
-            filp->f_flags |= F_OSPRD_LOCKED;
-
-            //add current pid to linked list of pids with read locks (NEEDS TO BE DONE)
-            if (d->read_list == NULL)
-			{
-				read_list_t new = kmalloc(sizeof(read_list_node), GFP_ATOMIC);
-				new->reader = current->pid;
-				new->next = NULL;
-				d->read_list = new;
-			}
-			else
-			{
-				read_list_t new = kmalloc(sizeof(read_list_node), GFP_ATOMIC);
-				new->reader = current->pid;
-				new->next = d->read_list;
-				d->read_list = new;
-			}
-            osp_spin_unlock(&d->mutex);
-            
-        }
+		r = osprd_acquire(d, filp, 0);
+	}
 
-	} 
-    
-    else if (cmd == OSPRDIOCRELEASE) 
+    else if (cmd == OSPRDIOCRELEASE)
     {
 		// EXERCISE: Unlock the ramdisk.
 		//
@@ -577,57 +2706,46 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 
 		// Your code here (instead of the next line).
 		//r = -ENOTTY;
-        
-        osp_spin_lock(&d->mutex);
-        //could also just check if filp->flag is locked
-        if (!d->ramdisk_WriteLocked && d->num_ReadLocks==0)
-        {
-            osp_spin_unlock(&d->mutex);
-            return -EINVAL;
-        }
-        
-        
-        if (filp_writable)
-        {
-            d->ramdisk_WriteLocked=0;
-            d->pid_holdingWriteLock=-1; //ensure no process holds write lock
-			//eprintk("PID %d RELEASED WRITE LOCK\n", current->pid);
-        }
-        else //ramdisk was locked on reading
-        {
-			if (d->read_list != NULL)
-			{
-				//remove current pid from read_pid list
-				if (d->read_list->reader == current->pid) // read lock in head
-				{
-					read_list_t del = d->read_list;
-					d->read_list = d->read_list->next;
-					kfree(del);
-				}
-				else // not in head (must be greater than 1 element)
-				{
-					read_list_t itr = d->read_list;
-					while(itr->next != NULL && itr->next->reader != current->pid)
-						itr = itr->next;
-					
-					if (itr->next != NULL)
-					{
-						read_list_t del = itr->next;
-						itr->next = itr->next->next;
-						kfree(del);
-					}
-				}
-				d->num_ReadLocks--;
-				//eprintk("PID %d RELEASED READ LOCK\n", current->pid);
-			}
-        }
+        r = osprd_unlock(d, filp);
+	}
+
+    else if (cmd == OSPRDIOCSETPOLICY)
+		r = osprd_set_policy(d, arg);
+
+    else if (cmd == OSPRDIOCSETLEASE)
+		r = osprd_set_lease(d, arg);
+
+    else if (cmd == OSPRDIOCRENEW)
+		r = osprd_renew(d, filp);
+
+    else if (cmd == OSPRDIOCRESIZE)
+		r = osprd_resize(d, filp, arg);
+
+    else if (cmd == OSPRDIOCSETQOS)
+		r = osprd_set_qos(d, (struct osprd_qos __user *) arg);
+
+    else if (cmd == OSPRDIOCQUERY)
+		r = osprd_query(d, (struct osprd_lockstate __user *) arg);
+
+    else if (cmd == OSPRDIOCRW)
+		r = osprd_rw(d, filp, (struct osprd_rw __user *) arg);
+
+    else if (cmd == OSPRDIOCSEQREAD)
+		r = osprd_seqread(d, filp, (struct osprd_iovec __user *) arg);
+
+    else if (cmd == OSPRDIOCSETSYNC)
+    {
+		// Switch this file between synchronous and write-back writes.
+		// Dirty pages are written out when switching back.
+		if (arg && !(filp->f_flags & O_SYNC))
+		{
+			filp->f_flags |= O_SYNC;
+			r = filemap_write_and_wait(filp->f_mapping);
+		}
+		else if (!arg)
+			filp->f_flags &= ~O_SYNC;
+	}
 
-        //chnage filp->flag to unlocked
-		wake_up_all(&d->blockq);
-        filp->f_flags &= !F_OSPRD_LOCKED;
-        osp_spin_unlock(&d->mutex);
-                
-	} 
     else
 		r = -ENOTTY; /* unknown command */
 	return r;
@@ -636,19 +2754,46 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 
 // Initialize internal fields for an osprd_info_t.
 
-static void osprd_setup(osprd_info_t *d)
+static int osprd_setup(osprd_info_t *d)
 {
+	int i;
+
 	/* Initialize the wait queue. */
 	init_waitqueue_head(&d->blockq);
+	init_waitqueue_head(&d->resizeq);
 	osp_spin_lock_init(&d->mutex);
 	d->ticket_head = d->ticket_tail = 0;
 	/* Add code here if you add fields to osprd_info_t. */
     d->ramdisk_WriteLocked=0;
     d->num_ReadLocks=0;
     d->pid_holdingWriteLock=-1;
+    d->writers=0;
+	d->wait_list = NULL;
+	d->policy = policy;
+	d->bypassed = 0;
+	d->read_phase_end = 0;
+	d->abandoned = 0;
+	d->lease = msecs_to_jiffies(lease_ms);
+	d->write_node = NULL;
+	d->revoked = NULL;
+	spin_lock_init(&d->qos_lock);
+	spin_lock_init(&d->zstat_lock);
+	for (i = 0; i < OSPRD_SEQ_LOCKS; i++)
+		seqlock_init(&d->seqlocks[i]);
+	d->qos_iops = qos_iops;
+	d->qos_kbps = qos_kbps;
     //add linked list part
 	d->read_list = NULL;
     d->dead_tix = NULL;
+
+	if (brlock) {
+		int cpu;
+		if (!(d->readers = alloc_percpu(osprd_reader_slot_t)))
+			return -1;
+		for_each_possible_cpu(cpu)
+			osp_spin_lock_init(&per_cpu_ptr(d->readers, cpu)->lock);
+	}
+	return 0;
 }
 
 
@@ -676,6 +2821,9 @@ static void osprd_process_request_queue(request_queue_t *q)
 
 static struct file_operations osprd_blk_fops;
 static int (*blkdev_release)(struct inode *, struct file *);
+static ssize_t (*blkdev_read)(struct file *, char __user *, size_t, loff_t *);
+static ssize_t (*blkdev_write)(struct file *, const char __user *, size_t,
+			       loff_t *);
 
 static int _osprd_release(struct inode *inode, struct file *filp)
 {
@@ -684,12 +2832,37 @@ static int _osprd_release(struct inode *inode, struct file *filp)
 	return (*blkdev_release)(inode, filp);
 }
 
+// A file whose lock was revoked must not touch the device any more.
+static ssize_t _osprd_read(struct file *filp, char __user *buf, size_t count,
+			   loff_t *ppos)
+{
+	osprd_info_t *d = file2osprd(filp);
+
+	if (d && osprd_is_revoked(d, filp))
+		return -ENOLCK;
+	return (*blkdev_read)(filp, buf, count, ppos);
+}
+
+static ssize_t _osprd_write(struct file *filp, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	osprd_info_t *d = file2osprd(filp);
+
+	if (d && osprd_is_revoked(d, filp))
+		return -ENOLCK;
+	return (*blkdev_write)(filp, buf, count, ppos);
+}
+
 static int _osprd_open(struct inode *inode, struct file *filp)
 {
 	if (!osprd_blk_fops.open) {
 		memcpy(&osprd_blk_fops, filp->f_op, sizeof(osprd_blk_fops));
 		blkdev_release = osprd_blk_fops.release;
 		osprd_blk_fops.release = _osprd_release;
+		blkdev_read = osprd_blk_fops.read;
+		osprd_blk_fops.read = _osprd_read;
+		blkdev_write = osprd_blk_fops.write;
+		osprd_blk_fops.write = _osprd_write;
 	}
 	filp->f_op = &osprd_blk_fops;
 	return osprd_open(inode, filp);
@@ -749,37 +2922,404 @@ static void for_each_open_file(struct task_struct *task,
 }
 
 
+// With 'compress', allocate chunk 'c' a page at a time.
+
+static int osprd_alloc_pages(osprd_chunk_t *c, int nid)
+{
+	unsigned j, npages = osprd_chunk_pages(c);
+
+	if (!(c->zpages = vmalloc_node(npages * sizeof(osprd_zpage_t), nid)))
+		return -1;
+	memset(c->zpages, 0, npages * sizeof(osprd_zpage_t));
+	for (j = 0; j < npages; j++) {
+		struct page *page = alloc_pages_node(nid, GFP_KERNEL, 0);
+		if (!page)
+			return -1;
+		c->zpages[j].data = page_address(page);
+		c->zpages[j].atime = jiffies;
+	}
+	c->node = page_to_nid(virt_to_page(c->zpages[0].data));
+	return 0;
+}
+
+
+// Allocate one chunk of 'size' bytes on NUMA node 'nid' (or anywhere, if
+// 'nid' is -1).  It is zeroed later; see osprd_chunk_ready().
+
+static int osprd_alloc_chunk(osprd_chunk_t *c, size_t size, int nid)
+{
+	struct page *page = NULL;
+	unsigned i;
+
+	c->nsect = size / SECTOR_SIZE;
+	c->order = -1;
+	c->zeroed = 0;
+	bitmap_zero(c->zclaimed, OSPRD_CHUNK_PAGES);
+	bitmap_zero(c->zdone, OSPRD_CHUNK_PAGES);
+	atomic_set(&c->zpending, osprd_chunk_pages(c));
+	spin_lock_init(&c->zlock);
+	if (compress) {
+		if (osprd_alloc_pages(c, nid) < 0)
+			return -1;
+	} else if (hugepages
+	    && (page = alloc_pages_node(nid, GFP_KERNEL | __GFP_NOWARN,
+					get_order(size)))) {
+		c->order = get_order(size);
+		c->data = page_address(page);
+	} else if (!(c->data = vmalloc_node(size, nid)))
+		return -1;
+	if (c->data)
+		c->node = page_to_nid(page ? page : vmalloc_to_page(c->data));
+
+	// Every sector starts out zero
+	if (checksum) {
+		if (!(c->crc = vmalloc_node(size / SECTOR_SIZE * sizeof(u32), nid)))
+			return -1;
+		c->crc[0] = osprd_sector_crc(page_address(ZERO_PAGE(0)));
+		for (i = 1; i < size / SECTOR_SIZE; i++)
+			c->crc[i] = c->crc[0];
+	}
+	return 0;
+}
+
+
+// Free one chunk.
+
+static void osprd_free_chunk(osprd_chunk_t *c)
+{
+	unsigned j;
+
+	if (c->crc)
+		vfree(c->crc);
+	if (c->zpages) {
+		for (j = 0; j < osprd_chunk_pages(c); j++) {
+			// Refill the reserve decompression draws on, if
+			// there is one
+			if (c->zpages[j].data && osprd_page_pool)
+				mempool_free(virt_to_page(c->zpages[j].data),
+					     osprd_page_pool);
+			else if (c->zpages[j].data)
+				__free_page(virt_to_page(c->zpages[j].data));
+			kfree(c->zpages[j].z);
+		}
+		vfree(c->zpages);
+		return;
+	} else if (!c->data)
+		return;
+	else if (c->order >= 0)
+		free_pages((unsigned long) c->data, c->order);
+	else
+		vfree(c->data);
+}
+
+
+// Free a device's chunks.
+
+static void osprd_free_chunks(osprd_info_t *d)
+{
+	unsigned i;
+	for (i = 0; d->chunks && i < d->nchunks; i++)
+		osprd_free_chunk(&d->chunks[i]);
+	kfree(d->chunks);
+	d->chunks = NULL;
+}
+
+
+// Return the NUMA node for chunk 'i' of osprds[which], as 'numa_node' and
+// 'interleave' say, or -1 for anywhere.
+
+static int osprd_chunk_node(int which, unsigned i)
+{
+	int nid = numa_node[which];
+	if (nid >= 0 || !interleave)
+		return nid;
+	for (nid = first_online_node, i %= num_online_nodes(); i > 0; i--)
+		nid = next_online_node(nid);
+	return nid;
+}
+
+
+// Allocate chunks 'from' up to 'to' of osprds[which] in the table 'chunks',
+// for a device 'nsect' sectors long.
+
+static int osprd_alloc_chunk_range(osprd_chunk_t *chunks, unsigned from,
+				   unsigned to, unsigned nsect, int which)
+{
+	unsigned i;
+	for (i = from; i < to; i++) {
+		unsigned n = min_t(unsigned, OSPRD_CHUNK_SECTORS,
+				   nsect - (i << OSPRD_CHUNK_SHIFT));
+		if (osprd_alloc_chunk(&chunks[i], n * SECTOR_SIZE,
+				      osprd_chunk_node(which, i)) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+// Find the NUMA node holding all of a device's data, if there is one.
+
+static void osprd_update_node(osprd_info_t *d)
+{
+	unsigned i;
+	d->node = d->chunks[0].node;
+	for (i = 1; i < d->nchunks; i++)
+		if (d->chunks[i].node != d->node)
+			d->node = -1;
+}
+
+
+// Allocate the chunks of osprds[which], placed as 'numa_node', 'interleave'
+// and 'hugepages' say.
+
+static int osprd_alloc_chunks(osprd_info_t *d, int which)
+{
+	int nid = numa_node[which];
+
+	if (nid >= MAX_NUMNODES || (nid >= 0 && !node_online(nid))) {
+		printk(KERN_WARNING "osprd: node %d is not online\n", nid);
+		return -1;
+	}
+
+	d->nchunks = (d->nsectors + OSPRD_CHUNK_SECTORS - 1) >> OSPRD_CHUNK_SHIFT;
+	if (!(d->chunks = kzalloc(d->nchunks * sizeof(osprd_chunk_t), GFP_KERNEL))
+	    || osprd_alloc_chunk_range(d->chunks, 0, d->nchunks, d->nsectors,
+				       which) < 0)
+		return -1;
+	osprd_update_node(d);
+	return 0;
+}
+
+
+// Wait for transfers that don't hold d->qlock to finish, and keep new ones
+// and request processing out, so the chunk table can change.
+
+static void osprd_io_pause(osprd_info_t *d)
+{
+	d->resizing = 1;
+	synchronize_rcu();
+	spin_lock_irq(&d->qlock);
+}
+
+static void osprd_io_resume(osprd_info_t *d)
+{
+	spin_unlock_irq(&d->qlock);
+	d->resizing = 0;
+	wake_up_all(&d->resizeq);
+}
+
+
+// Return 1 if sectors 'from' up to 'to' of 'd' are all zero.  Called with
+// I/O paused, so no one else touches a chunk's pages.
+
+static int osprd_sectors_zero(osprd_info_t *d, unsigned from, unsigned to)
+{
+	for (; from < to; from++) {
+		osprd_chunk_t *c = &d->chunks[from >> OSPRD_CHUNK_SHIFT];
+		unsigned offset = from & (OSPRD_CHUNK_SECTORS - 1);
+		unsigned long *p;
+		int i;
+
+		if (!c->zeroed
+		    && !test_bit(offset / SECTORS_PER_PAGE, c->zdone)) {
+			// Not zeroed yet, so all zeros
+			from |= SECTORS_PER_PAGE - 1;
+			continue;
+		} else if (c->zpages) {
+			osprd_zpage_t *zp = &c->zpages[offset / SECTORS_PER_PAGE];
+			if (!zp->data && !zp->z)
+				continue;	// A cold all-zero page
+			else if (!zp->data && osprd_inflate_page(d, zp) < 0)
+				return 0;
+			p = (unsigned long *) (zp->data + (offset % SECTORS_PER_PAGE)
+					       * SECTOR_SIZE);
+		} else
+			p = (unsigned long *) (c->data + offset * SECTOR_SIZE);
+		for (i = 0; i < SECTOR_SIZE / sizeof(long); i++)
+			if (p[i])
+				return 0;
+	}
+	return 1;
+}
+
+
+// Move the data of chunk 'from' into the longer chunk 'to'.
+
+static void osprd_move_chunk(osprd_chunk_t *to, osprd_chunk_t *from)
+{
+	unsigned j;
+
+	// If no page of 'from' was ever zeroed, it holds only zeros, and so
+	// does 'to'.  Otherwise transfers may have written some of its pages,
+	// so finish zeroing the rest and copy it all.
+	if (atomic_read(&from->zpending) == osprd_chunk_pages(from))
+		return;
+	osprd_zero_chunk(from, NULL);
+	osprd_zero_chunk(to, NULL);
+	if (!from->zpages) {
+		memcpy(to->data, from->data, from->nsect * SECTOR_SIZE);
+		return;
+	}
+	// With 'compress', pages change hands, resident or not
+	for (j = 0; j < osprd_chunk_pages(from); j++) {
+		if (to->zpages[j].data)
+			mempool_free(virt_to_page(to->zpages[j].data),
+				     osprd_page_pool);
+		to->zpages[j] = from->zpages[j];
+		memset(&from->zpages[j], 0, sizeof(osprd_zpage_t));
+	}
+}
+
+
+/*
+ * osprd_resize(d, filp, nsect)
+ *   Changes the size of 'd' to 'nsect' sectors while it stays in use.
+ *   Growing adds chunks and leaves the old ones where they are; only a
+ *   short last chunk is copied into a full-size one.  Shrinking only works
+ *   if every sector past the new end is zero, counting write-back data,
+ *   which is written out first.  Cached pages past the new end are dropped.
+ *   Growing pins kernel memory, so this needs CAP_SYS_ADMIN.
+ */
+static int osprd_resize(osprd_info_t *d, struct file *filp, unsigned long nsect)
+{
+	static DEFINE_MUTEX(resize_mutex);
+	struct block_device *bdev = filp->f_dentry->d_inode->i_bdev;
+	unsigned nchunks = (nsect + OSPRD_CHUNK_SECTORS - 1) >> OSPRD_CHUNK_SHIFT;
+	unsigned i, last, keep;
+	osprd_chunk_t *chunks, *old;
+	int which = d - osprds, replace = 0, shrink, r = 0;
+
+	if (d->layout != OSPRD_PLAIN || osprd_is_member(d))
+		return -EBUSY;
+	else if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	else if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	else if (nsect == 0 || nsect > INT_MAX)
+		return -EINVAL;
+
+	mutex_lock(&resize_mutex);
+	if (nsect == d->nsectors)
+		goto out;
+	shrink = (nsect < d->nsectors);
+	if (!(chunks = kzalloc(nchunks * sizeof(osprd_chunk_t), GFP_KERNEL))) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	// Old chunks are kept, except that the last one is replaced if it is
+	// too short for the new size
+	last = d->nchunks - 1;
+	keep = min_t(unsigned, nchunks, d->nchunks);
+	if ((last << OSPRD_CHUNK_SHIFT) + d->chunks[last].nsect < nsect) {
+		keep = last;
+		replace = 1;
+	}
+	if (osprd_alloc_chunk_range(chunks, keep, nchunks, nsect, which) < 0) {
+		r = -ENOMEM;
+		goto fail;
+	}
+
+	// Dirty pages past the new end must count in the check below
+	if (shrink && (r = filemap_write_and_wait(bdev->bd_inode->i_mapping)) < 0)
+		goto fail;
+
+	osprd_io_pause(d);
+	if (shrink && !osprd_sectors_zero(d, nsect, d->nsectors))
+		r = -EBUSY;
+	else {
+		memcpy(chunks, d->chunks, keep * sizeof(osprd_chunk_t));
+		if (replace) {
+			osprd_chunk_t *c = &d->chunks[last];
+			osprd_move_chunk(&chunks[last], c);
+			if (c->crc)
+				memcpy(chunks[last].crc, c->crc, c->nsect * sizeof(u32));
+		}
+		old = d->chunks;
+		d->chunks = chunks;
+		chunks = old;
+		i = d->nchunks;
+		d->nchunks = nchunks;
+		nchunks = i;
+		d->nsectors = nsect;
+	}
+	osprd_io_resume(d);
+
+	if (r == 0) {
+		set_capacity(d->gd, nsect);
+		mutex_lock(&bdev->bd_inode->i_mutex);
+		i_size_write(bdev->bd_inode, (loff_t) nsect * SECTOR_SIZE);
+		mutex_unlock(&bdev->bd_inode->i_mutex);
+		// Cached pages past the end must not stay readable
+		if (shrink)
+			truncate_inode_pages(bdev->bd_inode->i_mapping,
+					     (loff_t) nsect * SECTOR_SIZE);
+		osprd_update_node(d);
+		eprintk("osprd: %s resized to %lu sectors\n", d->gd->disk_name,
+			nsect);
+	}
+
+	// Free whichever chunks are no longer used: the old table's past
+	// 'keep', or on failure the new table's
+ fail:
+	for (i = keep; i < nchunks; i++)
+		osprd_free_chunk(&chunks[i]);
+	kfree(chunks);
+ out:
+	mutex_unlock(&resize_mutex);
+	return r;
+}
+
+
 // Destroy a osprd_info_t.
 
 static void cleanup_device(osprd_info_t *d)
 {
-	wake_up_all(&d->blockq);
+	int cpu;
+	// Only a device that got a disk went through osprd_setup()
 	if (d->gd) {
+		wake_up_all(&d->blockq);
 		del_gendisk(d->gd);
 		put_disk(d->gd);
 	}
 	if (d->queue)
 		blk_cleanup_queue(d->queue);
-	if (d->data)
-		vfree(d->data);
+	osprd_free_chunks(d);
+	read_list_free(&d->read_list);
+	read_list_free(&d->revoked);
+	kfree(d->write_node);
+	if (d->readers) {
+		for_each_possible_cpu(cpu)
+			read_list_free(&per_cpu_ptr(d->readers, cpu)->read_list);
+		free_percpu(d->readers);
+	}
 }
 
 
-// Initialize a osprd_info_t.
+// Set up the request queue and generic disk for a osprd_info_t whose
+// storage is ready, and make it visible as /dev/osprdX.
 
-static int setup_device(osprd_info_t *d, int which)
+static int setup_disk(osprd_info_t *d, int which)
 {
-	memset(d, 0, sizeof(osprd_info_t));
-
-	/* Get memory to store the actual block data. */
-	if (!(d->data = vmalloc(nsectors * SECTOR_SIZE)))
+	/* Call the setup function first, so a device with a disk always has
+	 * its wait queues and locks. */
+	if (policy < OSPRD_POLICY_FIFO || policy > OSPRD_POLICY_PHASEFAIR
+	    || osprd_setup(d) < 0)
 		return -1;
-	memset(d->data, 0, nsectors * SECTOR_SIZE);
 
 	/* Set up the I/O queue. */
 	spin_lock_init(&d->qlock);
-	if (!(d->queue = blk_init_queue(osprd_process_request_queue, &d->qlock)))
-		return -1;
+	if (mq) {
+		if (!(d->queue = blk_alloc_queue(GFP_KERNEL)))
+			return -1;
+		blk_queue_make_request(d->queue, osprd_make_request);
+	} else {
+		if (!(d->queue = blk_init_queue(osprd_process_request_queue, &d->qlock)))
+			return -1;
+		// Apply the I/O limits before bios are queued
+		d->queue_make_request = d->queue->make_request_fn;
+		d->queue->make_request_fn = osprd_queue_bio;
+	}
 	blk_queue_hardsect_size(d->queue, SECTOR_SIZE);
 	d->queue->queuedata = d;
 
@@ -792,18 +3332,296 @@ static int setup_device(osprd_info_t *d, int which)
 	d->gd->queue = d->queue;
 	d->gd->private_data = d;
 	snprintf(d->gd->disk_name, 32, "osprd%c", which + 'a');
-	set_capacity(d->gd, nsectors);
+	set_capacity(d->gd, d->nsectors);
+
 	add_disk(d->gd);
+	return 0;
+}
+
+
+// Initialize a osprd_info_t's storage.  setup_disk() does the rest.
+
+static int setup_device(osprd_info_t *d, int which)
+{
+	memset(d, 0, sizeof(osprd_info_t));
+
+	/* Get memory to store the actual block data. */
+	d->nsectors = nsectors;
+	if (nsectors <= 0 || osprd_alloc_chunks(d, which) < 0)
+		return -1;
+	d->writeback = writeback[which];
+	return 0;
+}
+
+
+/*
+ * Loading.
+ *
+ * Each device's storage is set up by its own kernel thread, running on
+ * the CPUs of the node the device's memory comes from, so big devices are
+ * allocated in parallel.  osprd_init() waits for every allocation to
+ * finish, then registers the disks in order.  Each loader thread stays
+ * behind to zero its device's chunks in the background.
+ */
+typedef struct osprd_loader {
+	struct task_struct *task;	// The loader thread, or NULL
+	struct completion done;		// Completed when the chunks are
+	int r;				// allocated, with this result
+} osprd_loader_t;
+
+static osprd_loader_t osprd_loaders[NOSPRD];
+static unsigned long osprd_load_start;	// When loading began, in jiffies
+static unsigned long osprd_load_ms;	// and how long it took
+
+static int osprd_load(void *arg)
+{
+	int which = (long) arg;
+	osprd_loader_t *l = &osprd_loaders[which];
+	osprd_info_t *d = &osprds[which];
+	unsigned i, j;
+
+	l->r = setup_device(d, which);
+	d->setup_ms = jiffies_to_msecs(jiffies - osprd_load_start);
+	complete(&l->done);
+
+	// Zero whatever no transfer has touched, including chunks a resize
+	// adds while this runs, a page at a time so others get the CPU
+	for (i = j = 0; l->r == 0 && !kthread_should_stop(); ) {
+		osprd_chunk_t *c;
+
+		osprd_io_begin(d);
+		if (i >= d->nchunks) {
+			osprd_io_end(d);
+			d->zero_ms = jiffies_to_msecs(jiffies - osprd_load_start);
+			break;
+		}
+		c = &d->chunks[i];
+		if (c->zeroed || j >= osprd_chunk_pages(c)) {
+			i++;
+			j = 0;
+		} else
+			osprd_zero_page(c, j++, NULL);
+		osprd_io_end(d);
+		cond_resched();
+	}
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+	return 0;
+}
+
+// Start setting up osprds[which].  If there is no thread to do it, set it
+// up right here; its chunks are then zeroed as transfers touch them.
+
+static void osprd_start_loader(int which)
+{
+	osprd_loader_t *l = &osprd_loaders[which];
+	int nid = numa_node[which];
+
+	init_completion(&l->done);
+	l->task = kthread_create(osprd_load, (void *) (long) which,
+				 "osprd_load/%d", which);
+	if (IS_ERR(l->task)) {
+		l->task = NULL;
+		l->r = setup_device(&osprds[which], which);
+		complete(&l->done);
+		return;
+	}
+	if (nid < 0 || nid >= MAX_NUMNODES || !node_online(nid))
+		nid = numa_node_id();
+	set_cpus_allowed(l->task, node_to_cpumask(nid));
+	wake_up_process(l->task);
+}
+
 
-	/* Call the setup function. */
-	osprd_setup(d);
+// Return 1 if 'm' already belongs to a composite device.
 
+static int osprd_is_member(osprd_info_t *m)
+{
+	int i;
+	for (i = 0; i < osprd_raid0.nmembers; i++)
+		if (osprd_raid0.members[i] == m)
+			return 1;
+	for (i = 0; i < osprd_mirror.nmembers; i++)
+		if (osprd_mirror.members[i] == m)
+			return 1;
 	return 0;
 }
 
+
+// Initialize a composite osprd_info_t with layout 'layout' from the member
+// list 'spec'.  A RAID-0 member contributes a whole number of chunks.
+
+static int setup_composite(osprd_info_t *d, int which, int layout,
+			   const char *spec)
+{
+	memset(d, 0, sizeof(osprd_info_t));
+
+	if (layout == OSPRD_RAID0 && (raid0_chunk <= 0 || nsectors < raid0_chunk))
+		return -1;
+	for (; *spec; spec++) {
+		osprd_info_t *m;
+		if (*spec < 'a' || *spec >= 'a' + NOSPRD)
+			return -1;
+		m = &osprds[*spec - 'a'];
+		if (osprd_is_member(m))
+			return -1;
+		d->members[d->nmembers++] = m;
+	}
+	d->layout = layout;
+
+	if (layout == OSPRD_RAID0)
+		d->nsectors = d->nmembers * (nsectors - nsectors % raid0_chunk);
+	else
+		d->nsectors = nsectors;
+	return setup_disk(d, which);
+}
+
 static void osprd_exit(void);
 
 
+// Describe a device's I/O limits in /proc/osprd, if it has any.
+
+static int osprd_proc_qos(char *page, osprd_info_t *d)
+{
+	if (!d->qos_iops && !d->qos_kbps && !d->throttled)
+		return 0;
+	return sprintf(page, ", limits %u iops %u KiB/s, throttled %lu bios"
+		       " for %lu ms", d->qos_iops, d->qos_kbps, d->throttled,
+		       d->throttle_ms);
+}
+
+
+// Describe a device's cold pages in /proc/osprd, with 'compress'.
+
+static int osprd_proc_compress(char *page, osprd_info_t *d)
+{
+	unsigned long packed = 0, zero = 0, bytes = 0, inflated, max_ns;
+	unsigned long long avg_ns, ratio;
+	unsigned i, j;
+
+	osprd_io_begin(d);
+	for (i = 0; i < d->nchunks; i++)
+		for (j = 0; j < osprd_chunk_pages(&d->chunks[i]); j++) {
+			osprd_zpage_t *zp = &d->chunks[i].zpages[j];
+			if (zp->data)
+				continue;
+			else if (zp->z) {
+				packed++;
+				bytes += zp->zlen;
+			} else
+				zero++;
+		}
+	osprd_io_end(d);
+
+	spin_lock(&d->zstat_lock);
+	inflated = d->inflated;
+	avg_ns = d->inflate_ns;
+	max_ns = d->inflate_max_ns;
+	spin_unlock(&d->zstat_lock);
+	if (inflated)
+		do_div(avg_ns, inflated);
+
+	// The ratio, in tenths, leaves out the all-zero pages
+	ratio = (unsigned long long) packed * PAGE_SIZE * 10;
+	if (bytes)
+		do_div(ratio, bytes);
+	return sprintf(page, ", compressed %lu pages to %lu KiB (%u.%u:1),"
+		       " %lu zero pages, decompressed %lu pages in %lu us avg"
+		       " %lu us max", packed, bytes / 1024,
+		       (unsigned) ratio / 10, (unsigned) ratio % 10,
+		       zero, inflated, (unsigned long) avg_ns / 1000,
+		       max_ns / 1000);
+}
+
+
+// Describe one device in /proc/osprd.
+
+static int osprd_proc_device(char *page, osprd_info_t *d)
+{
+	int len, i, nid, huge = 0, zeroed = 0;
+
+	len = sprintf(page, "%s: %u sectors", d->gd->disk_name, d->nsectors);
+	if (d->layout != OSPRD_PLAIN) {
+		len += sprintf(page + len, ", %s of",
+			       d->layout == OSPRD_RAID0 ? "raid0" : "mirror");
+		for (i = 0; i < d->nmembers; i++)
+			len += sprintf(page + len, " %s",
+				       d->members[i]->gd->disk_name);
+		len += osprd_proc_qos(page + len, d);
+		return len + sprintf(page + len, "\n");
+	}
+
+	for (i = 0; i < d->nchunks; i++) {
+		huge += (d->chunks[i].order >= 0);
+		zeroed += d->chunks[i].zeroed;
+	}
+	len += sprintf(page + len, ", %u chunks (%d huge), node",
+		       d->nchunks, huge);
+	for_each_online_node(nid) {
+		int n = 0;
+		for (i = 0; i < d->nchunks; i++)
+			n += (d->chunks[i].node == nid);
+		if (n)
+			len += sprintf(page + len, " %d:%d", nid, n);
+	}
+	if (checksum)
+		len += sprintf(page + len, ", checksum errors %d read %d scrub"
+			       " (%lu sectors scrubbed)",
+			       atomic_read(&d->crc_errors),
+			       atomic_read(&d->scrub_errors), d->scrubbed);
+	len += sprintf(page + len, ", allocated after %lu ms, %d zeroed (%d by"
+		       " I/O)", d->setup_ms, zeroed, atomic_read(&d->zeroed_by_io));
+	if (d->zero_ms)
+		len += sprintf(page + len, ", all zeroed after %lu ms",
+			       d->zero_ms);
+	if (compress)
+		len += osprd_proc_compress(page + len, d);
+	if (seqread)
+		len += sprintf(page + len, ", seqread retries %d fallbacks %d",
+			       atomic_read(&d->seq_retries),
+			       atomic_read(&d->seq_fallbacks));
+	len += osprd_proc_qos(page + len, d);
+	return len + sprintf(page + len, "\n");
+}
+
+
+// Produce /proc/osprd, which shows each device's size and where its data
+// lives: how many chunks are on each NUMA node, and how many are huge.
+// It shows how soon after loading began each device's chunks were allocated
+// and zeroed, and how long loading took.  With 'checksum', it also counts
+// checksum errors, with 'compress', it shows how well cold pages compress
+// and how long decompression takes, and with 'seqread', how often lockless
+// reads had to copy again.  It also shows each device's
+// I/O limits and how much I/O they held back.
+
+static int osprd_read_proc(char *page, char **start, off_t off, int count,
+			   int *eof, void *data)
+{
+	int len = 0, i;
+
+	for (i = 0; i < NOSPRD; i++)
+		len += osprd_proc_device(page + len, &osprds[i]);
+	if (osprd_raid0.gd)
+		len += osprd_proc_device(page + len, &osprd_raid0);
+	if (osprd_mirror.gd)
+		len += osprd_proc_device(page + len, &osprd_mirror);
+	len += sprintf(page + len, "loaded in %lu ms\n", osprd_load_ms);
+
+	if (len <= off + count)
+		*eof = 1;
+	*start = page + off;
+	len -= off;
+	if (len > count)
+		len = count;
+	return len < 0 ? 0 : len;
+}
+
+
 // The kernel calls this function when the module is loaded.
 // It initializes the 4 osprd block devices.
 
@@ -824,17 +3642,50 @@ static int __init osprd_init(void)
 		return -EBUSY;
 	}
 
-	/* Initialize the device structures. */
-	for (i = r = 0; i < NOSPRD; i++)
-		if (setup_device(&osprds[i], i) < 0)
+	crc32c_init();
+	osprd_load_start = jiffies;
+	r = 0;
+	if (compress && osprd_compress_init() < 0) {
+		printk(KERN_EMERG "osprd: can't set up compression\n");
+		osprd_compress_cleanup();
+		unregister_blkdev(OSPRD_MAJOR, "osprd");
+		return -ENOMEM;
+	}
+
+	/* Initialize the device structures, in parallel. */
+	for (i = 0; i < NOSPRD; i++)
+		osprd_start_loader(i);
+	for (i = 0; i < NOSPRD; i++) {
+		wait_for_completion(&osprd_loaders[i].done);
+		if (osprd_loaders[i].r < 0 || setup_disk(&osprds[i], i) < 0)
 			r = -EINVAL;
+	}
+	if (r == 0 && *raid0
+	    && setup_composite(&osprd_raid0, NOSPRD, OSPRD_RAID0, raid0) < 0)
+		r = -EINVAL;
+	if (r == 0 && *mirror
+	    && setup_composite(&osprd_mirror, NOSPRD + 1, OSPRD_MIRROR, mirror) < 0)
+		r = -EINVAL;
 
 	if (r < 0) {
 		printk(KERN_EMERG "osprd: can't set up device structures\n");
 		osprd_exit();
 		return -EBUSY;
-	} else
-		return 0;
+	}
+	create_proc_read_entry("osprd", 0, NULL, osprd_read_proc, NULL);
+	if (checksum) {
+		osprd_scrubber = kthread_run(osprd_scrub, NULL, "osprd_scrub");
+		if (IS_ERR(osprd_scrubber))
+			osprd_scrubber = NULL;
+	}
+	if (compress) {
+		osprd_compressor = kthread_run(osprd_compress, NULL,
+					       "osprd_compress");
+		if (IS_ERR(osprd_compressor))
+			osprd_compressor = NULL;
+	}
+	osprd_load_ms = jiffies_to_msecs(jiffies - osprd_load_start);
+	return 0;
 }
 
 
@@ -844,8 +3695,21 @@ static int __init osprd_init(void)
 static void osprd_exit(void)
 {
 	int i;
+	if (osprd_scrubber)
+		kthread_stop(osprd_scrubber);
+	if (osprd_compressor)
+		kthread_stop(osprd_compressor);
+	for (i = 0; i < NOSPRD; i++)
+		if (osprd_loaders[i].task)
+			kthread_stop(osprd_loaders[i].task);
+	remove_proc_entry("osprd", NULL);
+	if (osprd_mirror.gd)
+		cleanup_device(&osprd_mirror);
+	if (osprd_raid0.gd)
+		cleanup_device(&osprd_raid0);
 	for (i = 0; i < NOSPRD; i++)
 		cleanup_device(&osprds[i]);
+	osprd_compress_cleanup();
 	unregister_blkdev(OSPRD_MAJOR, "osprd");
 }
 
@@ -5,5 +5,65 @@
 #define OSPRDIOCACQUIRE		42
 #define OSPRDIOCTRYACQUIRE	43
 #define OSPRDIOCRELEASE		44
+#define OSPRDIOCSETPOLICY	45	// arg: OSPRD_POLICY_*; needs CAP_SYS_ADMIN
+#define OSPRDIOCSETLEASE	46	// arg: lease length in ms, 0 for none;
+					// needs CAP_SYS_ADMIN
+#define OSPRDIOCRENEW		47
+#define OSPRDIOCSETSYNC		48	// arg: 0 for write-back, 1 for O_SYNC
+#define OSPRDIOCRESIZE		49	// arg: new size in sectors;
+					// needs CAP_SYS_ADMIN
+#define OSPRDIOCSETQOS		50	// arg: struct osprd_qos *
+#define OSPRDIOCRW		51	// arg: struct osprd_rw *
+#define OSPRDIOCQUERY		52	// arg: struct osprd_lockstate *
+#define OSPRDIOCSEQREAD		53	// arg: struct osprd_iovec *
+
+// lock scheduling policies for OSPRDIOCSETPOLICY
+#define OSPRD_POLICY_FIFO	0	// strict ticket order
+#define OSPRD_POLICY_READERS	1	// readers may pass queued writers
+#define OSPRD_POLICY_WRITERS	2	// writers pass queued readers
+#define OSPRD_POLICY_PHASEFAIR	3	// read and write phases alternate
+
+// per-process I/O limits for OSPRDIOCSETQOS; 0 means no limit
+struct osprd_qos {
+	unsigned iops;		// bios per second
+	unsigned kbps;		// KiB per second
+};
+
+// one transfer in an OSPRDIOCRW batch: 'nsect' sectors starting at sector
+// 'sector', copied between the device and 'buf'; also the one read, of at
+// most a page, done by OSPRDIOCSEQREAD without taking the lock (needs the
+// 'seqread' module parameter, and not on a raid0 or mirror device)
+struct osprd_iovec {
+	unsigned sector;
+	unsigned nsect;
+	void *buf;
+	int dir;		// OSPRD_RW_READ or OSPRD_RW_WRITE
+};
+
+#define OSPRD_RW_READ		0
+#define OSPRD_RW_WRITE		1
+
+// a batch of transfers for OSPRDIOCRW, done in order; the ioctl returns
+// how many were done
+struct osprd_rw {
+	struct osprd_iovec *iov;
+	unsigned count;		// number of entries in 'iov'
+	unsigned flags;		// OSPRD_RW_* flags below
+};
+
+#define OSPRD_RW_LOCKED		1	// fail with ENOLCK unless the file
+					// holds the device lock; checked
+					// before every transfer
+
+// a snapshot of a device's lock, filled in by OSPRDIOCQUERY
+struct osprd_lockstate {
+	unsigned write_locked;	// 1 if a process holds the write lock
+	unsigned readers;	// read locks held
+	unsigned queued;	// tickets taken but not yet retired
+	unsigned waiters;	// lock requests blocked right now
+	unsigned oldest_wait_ms; // how long the oldest of them has waited
+	unsigned dead;		// retired tickets still waiting to be skipped
+	unsigned abandoned;	// requests ever given up after a signal
+};
 
 #endif
@@ -10,6 +10,17 @@
 
 #include "osprd.h"
 
+// Maximum number of devices that can be striped across with -s
+#define MAXDEVS		16
+
+// File descriptors below this may be traced with -T
+#define MAXFDS		256
+
+// Sector size, the number of sectors in one -V batch, and in one -S read
+#define SECTORSIZE	512
+#define VBATCH		64
+#define SBATCH		8
+
 void usage(int status)
 {
 	fprintf(stderr, "\
@@ -29,12 +40,103 @@ Usage: ./osprdaccess -w [SIZE] [OPTIONS] [DEVICE...] < DATA\n\
        -l would block, -L will return a \"resource busy\" error instead.\n\
    -d DELAY\n\
        Wait DELAY seconds before reading/writing (but after locking).\n\
+   -P POLICY\n\
+       Switch DEVICE to lock scheduling policy POLICY after opening it: 0 for\n\
+       FIFO, 1 for READERS, 2 for WRITERS, 3 for PHASEFAIR.  Needs root.\n\
+   -E LEASE\n\
+       Set DEVICE's lock lease to LEASE ms (0 for none) after opening it.\n\
+       A lock not renewed within its lease may be taken away.  Needs root.\n\
+   -e INTERVAL\n\
+       Renew the lock's lease every INTERVAL seconds during the -d DELAY.\n\
+   -s [STRIPE]\n\
+       Stripe the data across all the DEVICEs in units of STRIPE bytes\n\
+       (default 4096): stripe N goes to device N mod the number of devices.\n\
+       Each device is read or written by its own worker process.\n\
+   -b\n\
+       Buffer writes in the page cache (write-back) instead of writing each\n\
+       block through to the device, then fsync before exiting.\n\
+   -V\n\
+       Read or write with OSPRDIOCRW batches of one-sector transfers instead\n\
+       of read() and write().  OFF and SIZE must be multiples of 512.\n\
+   -S\n\
+       Read with OSPRDIOCSEQREAD, which does not take the lock, 4096 bytes at\n\
+       a time.  Needs the module's seqread parameter.  OFF and SIZE must be\n\
+       multiples of 512.\n\
+   -q\n\
+       Print a snapshot of DEVICE's lock state instead of reading or writing.\n\
+   -R NSECT\n\
+       Resize DEVICE to NSECT sectors after opening it.  Needs -w and root.\n\
+       Shrinking fails unless every sector past the new end is zero.\n\
+   -Q IOPS KBPS\n\
+       Limit every process to IOPS I/Os and KBPS KiB per second on DEVICE,\n\
+       where 0 means no limit.  Needs root.\n\
+   -T TRACE\n\
+       Append a timestamped record of every operation on the DEVICEs (open,\n\
+       lock, read, write, fsync, unlock, close) to the file TRACE.  Many processes\n\
+       may trace to the same file; ./osprdreplay replays it.\n\
+   A lock is released after reading/writing; it is an error if it was taken\n\
+   away meanwhile.\n\
    DEVICE is the device to read/write.  The default is /dev/osprda.\n\
    You can also give more than one device name.  All devices are opened, but\n\
-   only the last device is read or written.\n");
+   unless -s is given, only the last device is read or written.\n");
 	exit(status);
 }
 
+// The -T trace file, and the device name behind each traced descriptor
+int tracefd = -1;
+pid_t trace_pid;
+const char *trace_devname[MAXFDS];
+
+// Return 1 if operations on 'fd' are traced.
+int traced(int fd)
+{
+	return tracefd >= 0 && fd >= 0 && fd < MAXFDS && trace_devname[fd];
+}
+
+// Note the time an operation on 'fd' starts, and return the descriptor's
+// file position then (0 if 'fd' is not traced).
+off_t trace_start(int fd, struct timeval *start)
+{
+	if (!traced(fd))
+		return 0;
+	gettimeofday(start, 0);
+	return lseek(fd, 0, SEEK_CUR);
+}
+
+// Append a trace record for the operation 'op' on 'fd', which started at
+// '*start' and covered 'length' bytes at 'offset'.  Each record is a line
+//	SECONDS.MICROSECONDS PID DEVICE OP OFFSET LENGTH
+// written with a single write(), so concurrent tracers do not mix lines.
+void trace_op(int fd, const struct timeval *start, const char *op,
+	      off_t offset, ssize_t length)
+{
+	char buf[BUFSIZ];
+	int n;
+	if (!traced(fd))
+		return;
+	n = snprintf(buf, sizeof(buf), "%ld.%06ld %d %s %s %lld %lld\n",
+		     (long) start->tv_sec, (long) start->tv_usec,
+		     (int) getpid(), trace_devname[fd], op,
+		     (long long) offset, (long long) length);
+	if (write(tracefd, buf, n) != n) {
+		perror("trace");
+		exit(1);
+	}
+}
+
+// At exit, record that the traced devices are closed.  Striping workers
+// share the descriptors and leave this to the process that opened them.
+void trace_close_all(void)
+{
+	struct timeval now;
+	int fd;
+	if (getpid() != trace_pid)
+		return;
+	gettimeofday(&now, 0);
+	for (fd = 0; fd < MAXFDS; fd++)
+		trace_op(fd, &now, "close", 0, 0);
+}
+
 int parse_ssize(const char *arg, ssize_t *result)
 {
 	char *end_arg;
@@ -74,11 +176,14 @@ void sleep_for(double seconds)
 	}
 }
 
-void transfer(int fd1, int fd2, ssize_t size)
+ssize_t transfer(int fd1, int fd2, ssize_t size)
 {
 	char buf[BUFSIZ], *bufptr;
+	ssize_t total = 0;
 
 	while (size != 0) {
+		struct timeval start;
+		off_t pos = trace_start(fd1, &start);
 		ssize_t r = read(fd1, buf, (size > 0 && size < BUFSIZ ? size : BUFSIZ));
 		if (r < 0 && (errno == EAGAIN || errno == EINTR))
 			continue;
@@ -86,13 +191,16 @@ void transfer(int fd1, int fd2, ssize_t size)
 			perror("read");
 			exit(1);
 		} else if (r == 0)
-			return;
+			return total;
 		else
-			size -= r;
+			size -= r, total += r;
+		trace_op(fd1, &start, "read", pos, r);
 
 		bufptr = buf;
 		while (r > 0) {
-			ssize_t w = write(fd2, bufptr, r);
+			ssize_t w;
+			pos = trace_start(fd2, &start);
+			w = write(fd2, bufptr, r);
 			if (w < 0 && (errno == EAGAIN || errno == EINTR))
 				continue;
 			else if (w < 0 && errno == ENOSPC) /* end of file */
@@ -100,10 +208,13 @@ void transfer(int fd1, int fd2, ssize_t size)
 			else if (w < 0) {
 				perror("write");
 				exit(1);
-			} else
+			} else {
+				trace_op(fd2, &start, "write", pos, w);
 				bufptr += w, r -= w;
+			}
 		}
 	}
+	return total;
 }
 
 void transfer_zero(int fd2, ssize_t size)
@@ -112,6 +223,8 @@ void transfer_zero(int fd2, ssize_t size)
 	memset(buf, '\0', BUFSIZ);
 
 	while (size != 0) {
+		struct timeval start;
+		off_t pos = trace_start(fd2, &start);
 		ssize_t w = write(fd2, buf, (size > 0 && size < BUFSIZ ? size : BUFSIZ));
 		if (w < 0 && (errno == EAGAIN || errno == EINTR))
 			continue;
@@ -120,8 +233,245 @@ void transfer_zero(int fd2, ssize_t size)
 		else if (w < 0) {
 			perror("write");
 			exit(1);
-		} else
+		} else {
+			trace_op(fd2, &start, "write", pos, w);
 			size -= w;
+		}
+	}
+}
+
+// Compute which part of device 'dev' holds bytes [offset, offset + size)
+// of a stream striped across 'ndevs' devices in 'stripe'-byte units.
+// Returns the number of bytes; '*start' is set to their device offset.
+ssize_t stripe_extent(int dev, int ndevs, ssize_t stripe,
+		      ssize_t offset, ssize_t size, off_t *start)
+{
+	ssize_t pos = offset, len = 0;
+	*start = 0;
+
+	while (pos < offset + size) {
+		ssize_t s = pos / stripe;
+		ssize_t n = stripe - pos % stripe;
+		if (n > offset + size - pos)
+			n = offset + size - pos;
+		if (s % ndevs == dev) {
+			if (len == 0)
+				*start = (s / ndevs) * stripe + pos % stripe;
+			len += n;
+		}
+		pos += n;
+	}
+	return len;
+}
+
+// Read or write 'size' bytes of a stream striped across 'ndevs' devices,
+// starting at stream offset 'offset'.  One worker process per device moves
+// that device's stripes through a pipe; this process feeds the pipes from
+// standard input (or zeros), or reassembles them onto standard output.
+void transfer_striped(int *devfds, int ndevs, int writing, int zero,
+		      ssize_t stripe, ssize_t offset, ssize_t size)
+{
+	int pipes[MAXDEVS], status, failed = 0;
+	pid_t workers[MAXDEVS];
+	ssize_t pos;
+	int i, j;
+
+	for (i = 0; i < ndevs; i++) {
+		int pfd[2];
+		off_t start;
+		ssize_t len = stripe_extent(i, ndevs, stripe, offset, size, &start);
+
+		if (pipe(pfd) == -1) {
+			perror("pipe");
+			exit(1);
+		}
+		workers[i] = fork();
+		if (workers[i] == -1) {
+			perror("fork");
+			exit(1);
+		} else if (workers[i] == 0) {
+			for (j = 0; j < i; j++)
+				close(pipes[j]);
+			if (lseek(devfds[i], start, SEEK_SET) == (off_t) -1) {
+				perror("lseek");
+				exit(1);
+			}
+			if (writing) {
+				close(pfd[1]);
+				transfer(pfd[0], devfds[i], len);
+			} else {
+				close(pfd[0]);
+				transfer(devfds[i], pfd[1], len);
+			}
+			exit(0);
+		}
+		if (writing) {
+			close(pfd[0]);
+			pipes[i] = pfd[1];
+		} else {
+			close(pfd[1]);
+			pipes[i] = pfd[0];
+		}
+	}
+
+	// Walk the stream one stripe at a time
+	pos = offset;
+	while (pos < offset + size) {
+		int dev = (pos / stripe) % ndevs;
+		ssize_t n = stripe - pos % stripe, r;
+		if (n > offset + size - pos)
+			n = offset + size - pos;
+
+		if (writing && zero) {
+			transfer_zero(pipes[dev], n);
+			r = n;
+		} else if (writing)
+			r = transfer(STDIN_FILENO, pipes[dev], n);
+		else
+			r = transfer(pipes[dev], STDOUT_FILENO, n);
+		if (r < n)
+			break;
+		pos += n;
+	}
+
+	for (i = 0; i < ndevs; i++)
+		close(pipes[i]);
+	for (i = 0; i < ndevs; i++)
+		if (waitpid(workers[i], &status, 0) == -1
+		    || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+	if (failed) {
+		fprintf(stderr, "osprdaccess: striping worker failed\n");
+		exit(1);
+	}
+}
+
+// Read or write 'size' bytes of 'devfd' starting at 'offset' with
+// OSPRDIOCRW batches of one-sector transfers.  With 'locked', the batches
+// fail unless the device is locked.  A short final sector read from
+// standard input is padded with zeros.
+void transfer_vector(int devfd, int writing, int zero, int locked,
+		     ssize_t offset, ssize_t size)
+{
+	char buf[VBATCH * SECTORSIZE];
+	struct osprd_iovec iov[VBATCH];
+	struct osprd_rw rw;
+	struct timeval start;
+	int i, n, r;
+
+	if (size < 0)
+		size = lseek(devfd, 0, SEEK_END) - offset;
+	if (offset % SECTORSIZE || size % SECTORSIZE) {
+		fprintf(stderr, "osprdaccess: -V needs whole sectors\n");
+		exit(1);
+	}
+
+	while (size > 0) {
+		n = (size / SECTORSIZE < VBATCH ? size / SECTORSIZE : VBATCH);
+		if (writing) {
+			ssize_t len = 0;
+			memset(buf, 0, n * SECTORSIZE);
+			while (!zero && len < n * SECTORSIZE) {
+				ssize_t r = read(STDIN_FILENO, buf + len, n * SECTORSIZE - len);
+				if (r < 0 && (errno == EAGAIN || errno == EINTR))
+					continue;
+				else if (r < 0) {
+					perror("read");
+					exit(1);
+				} else if (r == 0)
+					break;
+				len += r;
+			}
+			if (!zero)
+				n = (len + SECTORSIZE - 1) / SECTORSIZE;
+			if (n == 0)
+				return;
+		}
+
+		for (i = 0; i < n; i++) {
+			iov[i].sector = offset / SECTORSIZE + i;
+			iov[i].nsect = 1;
+			iov[i].buf = buf + i * SECTORSIZE;
+			iov[i].dir = writing ? OSPRD_RW_WRITE : OSPRD_RW_READ;
+		}
+		rw.iov = iov;
+		rw.count = n;
+		rw.flags = locked ? OSPRD_RW_LOCKED : 0;
+		trace_start(devfd, &start);
+		r = ioctl(devfd, OSPRDIOCRW, &rw);
+		if (r == -1) {
+			perror("ioctl OSPRDIOCRW");
+			exit(1);
+		}
+		for (i = 0; i < r; i++)
+			trace_op(devfd, &start, writing ? "write" : "read",
+				 offset + i * SECTORSIZE, SECTORSIZE);
+		if (r < n) {
+			fprintf(stderr, "osprdaccess: OSPRDIOCRW did %d of %d transfers\n", r, n);
+			exit(1);
+		}
+
+		if (!writing) {
+			char *bufptr = buf;
+			ssize_t left = n * SECTORSIZE;
+			while (left > 0) {
+				ssize_t w = write(STDOUT_FILENO, bufptr, left);
+				if (w < 0 && (errno == EAGAIN || errno == EINTR))
+					continue;
+				else if (w < 0) {
+					perror("write");
+					exit(1);
+				}
+				bufptr += w, left -= w;
+			}
+		}
+		offset += n * SECTORSIZE;
+		size -= n * SECTORSIZE;
+	}
+}
+
+void transfer_seqread(int devfd, ssize_t offset, ssize_t size)
+{
+	char buf[SBATCH * SECTORSIZE];
+	struct osprd_iovec v;
+	struct timeval start;
+	int n;
+
+	if (size < 0)
+		size = lseek(devfd, 0, SEEK_END) - offset;
+	if (offset % SECTORSIZE || size % SECTORSIZE) {
+		fprintf(stderr, "osprdaccess: -S needs whole sectors\n");
+		exit(1);
+	}
+
+	while (size > 0) {
+		char *bufptr = buf;
+		ssize_t left;
+
+		n = (size / SECTORSIZE < SBATCH ? size / SECTORSIZE : SBATCH);
+		v.sector = offset / SECTORSIZE;
+		v.nsect = n;
+		v.buf = buf;
+		v.dir = OSPRD_RW_READ;
+		trace_start(devfd, &start);
+		if (ioctl(devfd, OSPRDIOCSEQREAD, &v) == -1) {
+			perror("ioctl OSPRDIOCSEQREAD");
+			exit(1);
+		}
+		trace_op(devfd, &start, "read", offset, n * SECTORSIZE);
+
+		for (left = n * SECTORSIZE; left > 0; ) {
+			ssize_t w = write(STDOUT_FILENO, bufptr, left);
+			if (w < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			else if (w < 0) {
+				perror("write");
+				exit(1);
+			}
+			bufptr += w, left -= w;
+		}
+		offset += n * SECTORSIZE;
+		size -= n * SECTORSIZE;
 	}
 }
 
@@ -130,12 +480,21 @@ int main(int argc, char *argv[])
 	char *newarg;
 	int devfd, ofd;
 	int i, r, timeout = 0, zero = 0;
-	int mode = O_RDONLY, dolock = 0, dotrylock = 0;
+	int mode = O_RDONLY, dolock = 0, dotrylock = 0, writeback = 0, vector = 0;
+	int query = 0, seq = 0;
+	int devfds[MAXDEVS], devmodes[MAXDEVS], ndevs = 0;
 	ssize_t size = -1;
 	ssize_t offset = 0;
+	ssize_t stripe = 0;
+	ssize_t resize = 0;
+	ssize_t qos_iops = -1, qos_kbps = -1;
 	double delay = 0;
 	double lock_delay = 0;
+	double renew = 0;
+	ssize_t lease = -1;
+	ssize_t policy = -1;
 	const char *devname = "/dev/osprda";
+	struct timeval start;
 
  flag:
 	// Detect a read/write option
@@ -189,6 +548,104 @@ int main(int argc, char *argv[])
 		goto flag;
 	}
 
+	// Detect a policy option
+	if (argc >= 2 && strcmp(argv[1], "-P") == 0) {
+		if (argc < 3 || !parse_ssize(argv[2], &policy))
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
+	// Detect a lease option
+	if (argc >= 2 && strcmp(argv[1], "-E") == 0) {
+		if (argc < 3 || !parse_ssize(argv[2], &lease) || lease < 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
+	// Detect a lease renewal option
+	if (argc >= 2 && strcmp(argv[1], "-e") == 0) {
+		if (argc < 3 || !parse_double(argv[2], &renew) || renew <= 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
+	// Detect a stripe option
+	if (argc >= 2 && strcmp(argv[1], "-s") == 0) {
+		stripe = 4096;
+		argv++, argc--;
+		if (argc >= 2 && parse_ssize(argv[1], &stripe))
+			argv++, argc--;
+		if (stripe <= 0)
+			usage(1);
+		goto flag;
+	}
+
+	// Detect a write-back option
+	if (argc >= 2 && strcmp(argv[1], "-b") == 0) {
+		writeback = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a vectored I/O option
+	if (argc >= 2 && strcmp(argv[1], "-V") == 0) {
+		vector = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a lockless read option
+	if (argc >= 2 && strcmp(argv[1], "-S") == 0) {
+		seq = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a query option
+	if (argc >= 2 && strcmp(argv[1], "-q") == 0) {
+		query = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a resize option
+	if (argc >= 2 && strcmp(argv[1], "-R") == 0) {
+		if (argc < 3 || !parse_ssize(argv[2], &resize) || resize <= 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
+	// Detect an I/O limit option
+	if (argc >= 2 && strcmp(argv[1], "-Q") == 0) {
+		if (argc < 4 || !parse_ssize(argv[2], &qos_iops)
+		    || !parse_ssize(argv[3], &qos_kbps)
+		    || qos_iops < 0 || qos_kbps < 0)
+			usage(1);
+		argv += 3, argc -= 3;
+		goto flag;
+	}
+
+	// Detect a trace option
+	if (argc >= 2 && strcmp(argv[1], "-T") == 0) {
+		if (argc < 3)
+			usage(1);
+		if (tracefd < 0) {
+			tracefd = open(argv[2], O_WRONLY | O_CREAT | O_APPEND, 0666);
+			if (tracefd == -1) {
+				perror(argv[2]);
+				exit(1);
+			}
+			trace_pid = getpid();
+			atexit(trace_close_all);
+		}
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
 	// Detect a zeroes option
 	if (argc >= 2 && strcmp(argv[1], "-z") == 0) {
 		zero = 1;
@@ -207,16 +664,74 @@ int main(int argc, char *argv[])
 	}
 
 	// Open ramdisk file
+	gettimeofday(&start, 0);
 	devfd = open(devname, mode);
 	if (devfd == -1) {
 		perror("open");
 		exit(1);
 	}
+	if (tracefd >= 0 && devfd < MAXFDS) {
+		trace_devname[devfd] = devname;
+		trace_op(devfd, &start, mode == O_WRONLY ? "open-w" : "open-r", 0, 0);
+	}
+
+	// Change the lock scheduling policy
+	if (policy != -1 && ioctl(devfd, OSPRDIOCSETPOLICY, (unsigned long) policy) == -1) {
+		perror("ioctl OSPRDIOCSETPOLICY");
+		exit(1);
+	}
+
+	// Change the lock lease
+	if (lease >= 0 && ioctl(devfd, OSPRDIOCSETLEASE, (unsigned long) lease) == -1) {
+		perror("ioctl OSPRDIOCSETLEASE");
+		exit(1);
+	}
+
+	// Change the device's size
+	if (resize && ioctl(devfd, OSPRDIOCRESIZE, (unsigned long) resize) == -1) {
+		perror("ioctl OSPRDIOCRESIZE");
+		exit(1);
+	}
+
+	// Set the I/O limits
+	if (qos_iops >= 0) {
+		struct osprd_qos qos;
+		qos.iops = qos_iops;
+		qos.kbps = qos_kbps;
+		if (ioctl(devfd, OSPRDIOCSETQOS, &qos) == -1) {
+			perror("ioctl OSPRDIOCSETQOS");
+			exit(1);
+		}
+	}
+
+	// Print the lock state
+	if (query) {
+		struct osprd_lockstate state;
+		if (ioctl(devfd, OSPRDIOCQUERY, &state) == -1) {
+			perror("ioctl OSPRDIOCQUERY");
+			exit(1);
+		}
+		printf("write_locked %u\nreaders %u\nqueued %u\nwaiters %u\n"
+		       "oldest_wait_ms %u\ndead %u\nabandoned %u\n",
+		       state.write_locked, state.readers, state.queued,
+		       state.waiters, state.oldest_wait_ms, state.dead,
+		       state.abandoned);
+		exit(0);
+	}
+
+	// Let writes sit in the page cache
+	trace_start(devfd, &start);
+	if (writeback && ioctl(devfd, OSPRDIOCSETSYNC, 0) == -1) {
+		perror("ioctl OSPRDIOCSETSYNC");
+		exit(1);
+	} else if (writeback)
+		trace_op(devfd, &start, "writeback", 0, 0);
 
 	// Lock, possibly after delay
 	if (dolock || dotrylock) {
 		if (lock_delay >= 0)
 			sleep_for(lock_delay);
+		trace_start(devfd, &start);
 		if (dolock
 		    && ioctl(devfd, OSPRDIOCACQUIRE, NULL) == -1) {
 			perror("ioctl OSPRDIOCACQUIRE");
@@ -226,16 +741,67 @@ int main(int argc, char *argv[])
 			perror("ioctl OSPRDIOCTRYACQUIRE");
 			exit(1);
 		}
+		trace_op(devfd, &start, dolock ? "lock" : "trylock", 0, 0);
 	}
 
-	// Delay
+	// Delay, renewing the lease along the way
+	while ((dolock || dotrylock) && renew > 0 && delay > renew) {
+		sleep_for(renew);
+		delay -= renew;
+		if (ioctl(devfd, OSPRDIOCRENEW, NULL) == -1) {
+			perror("ioctl OSPRDIOCRENEW");
+			exit(1);
+		}
+	}
 	if (delay >= 0)
 		sleep_for(delay);
 
+	// Remember the device in case we stripe across all of them
+	if (ndevs == MAXDEVS) {
+		fprintf(stderr, "osprdaccess: too many devices\n");
+		exit(1);
+	}
+	devfds[ndevs] = devfd;
+	devmodes[ndevs] = mode;
+	ndevs++;
+
 	// If more arguments, go around for the next ramdisk
 	if (argc > 1)
 		goto flag;
 
+	// Stripe across all devices
+	if (stripe) {
+		ssize_t devsize = -1;
+		for (i = 0; i < ndevs; i++) {
+			off_t end = lseek(devfds[i], 0, SEEK_END);
+			if (end == (off_t) -1) {
+				perror("lseek");
+				exit(1);
+			} else if (devmodes[i] != mode) {
+				fprintf(stderr, "osprdaccess: striped devices must all be read or all be written\n");
+				exit(1);
+			}
+			if (devsize < 0 || end < devsize)
+				devsize = end;
+		}
+		// Never run past the end of the smallest device
+		devsize -= devsize % stripe;
+		if (size < 0 || offset + size > devsize * ndevs)
+			size = devsize * ndevs - offset;
+		if (size > 0)
+			transfer_striped(devfds, ndevs, mode & O_WRONLY, zero,
+					 stripe, offset, size);
+		for (i = 0; writeback && i < ndevs; i++) {
+			trace_start(devfds[i], &start);
+			if (fsync(devfds[i]) == -1) {
+				perror("fsync");
+				exit(1);
+			}
+			trace_op(devfds[i], &start, "fsync", 0, 0);
+		}
+		exit(0);
+	}
+
 	// Seek to offset
 	if (lseek(devfd, offset, SEEK_SET) == (off_t) -1) {
 		perror("lseek");
@@ -243,12 +809,36 @@ int main(int argc, char *argv[])
 	}
 
 	// Read or write
-	if ((mode & O_WRONLY) && zero)
+	if (seq && (mode & O_WRONLY)) {
+		fprintf(stderr, "osprdaccess: -S only reads\n");
+		exit(1);
+	} else if (seq)
+		transfer_seqread(devfd, offset, size);
+	else if (vector)
+		transfer_vector(devfd, mode & O_WRONLY, zero, dolock || dotrylock,
+				offset, size);
+	else if ((mode & O_WRONLY) && zero)
 		transfer_zero(devfd, size);
 	else if (mode & O_WRONLY)
 		transfer(STDIN_FILENO, devfd, size);
 	else
 		transfer(devfd, STDOUT_FILENO, size);
 
+	// Make buffered writes durable
+	trace_start(devfd, &start);
+	if (writeback && fsync(devfd) == -1) {
+		perror("fsync");
+		exit(1);
+	} else if (writeback)
+		trace_op(devfd, &start, "fsync", 0, 0);
+
+	// Unlock, which fails if the lease ran out
+	trace_start(devfd, &start);
+	if ((dolock || dotrylock) && ioctl(devfd, OSPRDIOCRELEASE, NULL) == -1) {
+		perror("ioctl OSPRDIOCRELEASE");
+		exit(1);
+	} else if (dolock || dotrylock)
+		trace_op(devfd, &start, "unlock", 0, 0);
+
 	exit(0);
 }
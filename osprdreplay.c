@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "osprd.h"
+
+// Maximum number of devices one traced process may have open
+#define MAXDEVS		16
+
+void usage(int status)
+{
+	fprintf(stderr, "\
+Replays a trace of OSP ramdisk operations recorded with \"osprdaccess -T\".\n\
+Usage: ./osprdreplay [-f] TRACE\n\
+   Every process in the trace gets its own worker process, which repeats\n\
+   that process's operations in order: opens, locks, reads, writes (of\n\
+   zeros, so replaying a write destroys data), fsyncs, unlocks and closes.\n\
+   A process id that opens a device again after closing all of its devices\n\
+   belongs to a new process, so it gets a new worker.  The\n\
+   workers run at the same time, so the traced processes contend for locks\n\
+   and devices again.  By default each operation starts when it started in\n\
+   the trace, relative to the first one.  Options are:\n\
+   -f\n\
+       Replay as fast as possible: each worker starts its next operation as\n\
+       soon as its last one finishes.\n\
+   Afterwards, prints the count and latency of each kind of operation, and\n\
+   the throughput of the whole replay.\n");
+	exit(status);
+}
+
+// Operations, as named in trace records
+enum { OP_OPEN_R, OP_OPEN_W, OP_LOCK, OP_TRYLOCK, OP_UNLOCK, OP_READ,
+       OP_WRITE, OP_WRITEBACK, OP_FSYNC, OP_CLOSE, NOPS };
+const char *opnames[NOPS] = {
+	"open-r", "open-w", "lock", "trylock", "unlock", "read", "write",
+	"writeback", "fsync", "close"
+};
+
+// One trace record
+typedef struct record {
+	long long time;		// When the operation started, in us
+	int pid;		// The traced process, and how many earlier
+	int epoch;		// processes had its id
+	char *dev;		// The device it used
+	int op;			// OP_*
+	long long offset;	// Bytes transferred by a read or write
+	long long length;
+	int index;		// Position in the trace
+} record_t;
+
+// The latencies of one kind of operation
+typedef struct opstats {
+	long long *latency;	// in us
+	int n, size;
+	int failed;
+	long long bytes;
+} opstats_t;
+
+long long now_us(void)
+{
+	struct timeval now;
+	gettimeofday(&now, 0);
+	return now.tv_sec * 1000000LL + now.tv_usec;
+}
+
+void sleep_until(long long end)
+{
+	struct timeval delta;
+	long long now;
+
+	while ((now = now_us()) < end) {
+		delta.tv_sec = (end - now) / 1000000;
+		delta.tv_usec = (end - now) % 1000000;
+		(void) select(0, 0, 0, 0, &delta);
+	}
+}
+
+// Read the trace 'filename'.  Returns its records; '*nrecords' is set to
+// their number.
+record_t *read_trace(const char *filename, int *nrecords)
+{
+	char line[BUFSIZ], dev[BUFSIZ], op[BUFSIZ];
+	record_t *records = NULL;
+	int n = 0, size = 0, lineno = 0;
+	FILE *f = fopen(filename, "r");
+
+	if (!f) {
+		perror(filename);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		record_t r;
+		long long sec, usec;
+		lineno++;
+		if (sscanf(line, "%lld.%lld %d %s %s %lld %lld", &sec, &usec,
+			   &r.pid, dev, op, &r.offset, &r.length) != 7) {
+			fprintf(stderr, "%s:%d: bad trace record\n", filename, lineno);
+			exit(1);
+		}
+		for (r.op = 0; r.op < NOPS; r.op++)
+			if (strcmp(op, opnames[r.op]) == 0)
+				break;
+		if (r.op == NOPS) {
+			fprintf(stderr, "%s:%d: unknown operation %s\n", filename, lineno, op);
+			exit(1);
+		}
+		r.time = sec * 1000000 + usec;
+		r.dev = strdup(dev);
+		r.epoch = 0;
+		r.index = n;
+
+		if (n == size) {
+			size = size ? size * 2 : 256;
+			records = realloc(records, size * sizeof(record_t));
+		}
+		if (!records || !r.dev) {
+			fprintf(stderr, "osprdreplay: out of memory\n");
+			exit(1);
+		}
+		records[n++] = r;
+	}
+	fclose(f);
+	*nrecords = n;
+	return records;
+}
+
+// Order records by process, keeping each process's records in trace order.
+int record_cmp(const void *a, const void *b)
+{
+	const record_t *ra = a, *rb = b;
+	if (ra->pid != rb->pid)
+		return ra->pid < rb->pid ? -1 : 1;
+	else if (ra->epoch != rb->epoch)
+		return ra->epoch - rb->epoch;
+	return ra->index - rb->index;
+}
+
+// Tell apart the processes that had the same id, in the 'n' records sorted
+// by record_cmp() before their epochs are known.  osprdaccess records
+// closing every device when it exits, so a process id that opens a device
+// while it has none open belongs to a new process.
+void number_epochs(record_t *records, int n)
+{
+	int i, nopen = 0;
+
+	for (i = 0; i < n; i++) {
+		record_t *r = &records[i];
+		int open = (r->op == OP_OPEN_R || r->op == OP_OPEN_W);
+		if (i == 0 || r->pid != records[i - 1].pid) {
+			r->epoch = 0;
+			nopen = 0;
+		} else
+			r->epoch = records[i - 1].epoch + (open && nopen == 0);
+		if (open)
+			nopen++;
+		else if (r->op == OP_CLOSE && nopen > 0)
+			nopen--;
+	}
+}
+
+// Send a worker's buffered results up the pipe.  Each write holds whole
+// lines and is at most PIPE_BUF bytes, so workers' results do not mix.
+void flush_results(int out, char *buf, size_t *len)
+{
+	if (*len && write(out, buf, *len) != (ssize_t) *len) {
+		perror("write");
+		exit(1);
+	}
+	*len = 0;
+}
+
+// Replay the 'n' records of one process.  Operations start 'start' plus
+// their offset from 'first' microseconds, or right away if 'fast'.  Writes
+// one "OP FAILED LATENCY BYTES" line per operation to 'out'.
+void replay_process(record_t *rec, int n, long long first, long long start,
+		    int fast, int out)
+{
+	const char *devs[MAXDEVS];
+	int fds[MAXDEVS], ndevs = 0;
+	char *buf = NULL, results[PIPE_BUF];
+	size_t bufsize = 0, len = 0;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		record_t *r = &rec[i];
+		long long begin;
+		int fd = -1, ok = 0, opened = 0;
+
+		for (j = 0; j < ndevs; j++)
+			if (strcmp(devs[j], r->dev) == 0)
+				fd = fds[j];
+		if ((r->op == OP_READ || r->op == OP_WRITE)
+		    && r->length > (long long) bufsize) {
+			bufsize = r->length;
+			if (!(buf = realloc(buf, bufsize))) {
+				fprintf(stderr, "osprdreplay: out of memory\n");
+				exit(1);
+			}
+			memset(buf, 0, bufsize);
+		}
+		if (!fast)
+			sleep_until(start + r->time - first);
+
+		begin = now_us();
+		// A process can read and write a device it did not open, such
+		// as a striping worker using its parent's descriptor; open it
+		// then.
+		if (fd < 0 && (r->op == OP_READ || r->op == OP_WRITE)) {
+			fd = open(r->dev, r->op == OP_WRITE ? O_WRONLY : O_RDONLY);
+			opened = 1;
+		}
+		switch (r->op) {
+		case OP_OPEN_R:
+		case OP_OPEN_W:
+			fd = open(r->dev, r->op == OP_OPEN_W ? O_WRONLY : O_RDONLY);
+			opened = 1;
+			ok = (fd >= 0);
+			break;
+		case OP_LOCK:
+			ok = (ioctl(fd, OSPRDIOCACQUIRE, NULL) == 0);
+			break;
+		case OP_TRYLOCK:
+			ok = (ioctl(fd, OSPRDIOCTRYACQUIRE, NULL) == 0);
+			break;
+		case OP_UNLOCK:
+			ok = (ioctl(fd, OSPRDIOCRELEASE, NULL) == 0);
+			break;
+		case OP_READ:
+			ok = (pread(fd, buf, r->length, r->offset) == r->length);
+			break;
+		case OP_WRITE:
+			ok = (pwrite(fd, buf, r->length, r->offset) == r->length);
+			break;
+		case OP_WRITEBACK:
+			ok = (ioctl(fd, OSPRDIOCSETSYNC, 0) == 0);
+			break;
+		case OP_FSYNC:
+			ok = (fsync(fd) == 0);
+			break;
+		case OP_CLOSE:
+			ok = (fd >= 0 && close(fd) == 0);
+			for (j = 0; j < ndevs; j++)
+				if (fds[j] == fd) {
+					devs[j] = devs[ndevs - 1];
+					fds[j] = fds[--ndevs];
+					break;
+				}
+			fd = -1;
+			break;
+		}
+		// Remember a newly opened device
+		if (opened && fd >= 0 && ndevs < MAXDEVS) {
+			devs[ndevs] = r->dev;
+			fds[ndevs++] = fd;
+		}
+
+		if (len + 64 > sizeof(results))
+			flush_results(out, results, &len);
+		len += sprintf(results + len, "%d %d %lld %lld\n", r->op, !ok,
+			       now_us() - begin,
+			       ok && (r->op == OP_READ || r->op == OP_WRITE)
+			       ? r->length : 0);
+	}
+	flush_results(out, results, &len);
+	exit(0);
+}
+
+int latency_cmp(const void *a, const void *b)
+{
+	long long la = *(const long long *) a, lb = *(const long long *) b;
+	return la < lb ? -1 : la > lb;
+}
+
+// Return the 'frac' quantile of a sorted list of latencies, in ms.
+double quantile(opstats_t *s, double frac)
+{
+	return s->n ? s->latency[(int) ((s->n - 1) * frac)] / 1000.0 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	record_t *records;
+	opstats_t stats[NOPS];
+	char line[BUFSIZ];
+	int nrecords, fast = 0, nworkers = 0, failed = 0;
+	int i, j, pfd[2], status;
+	long long first, start, elapsed, total_ops = 0, total_bytes = 0;
+	FILE *results;
+
+	if (argc >= 2 && strcmp(argv[1], "-f") == 0) {
+		fast = 1;
+		argv++, argc--;
+	}
+	if (argc >= 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+		usage(0);
+	if (argc != 2)
+		usage(1);
+
+	records = read_trace(argv[1], &nrecords);
+	if (nrecords == 0) {
+		fprintf(stderr, "osprdreplay: %s is empty\n", argv[1]);
+		exit(1);
+	}
+	first = records[0].time;
+	for (i = 1; i < nrecords; i++)
+		if (records[i].time < first)
+			first = records[i].time;
+	qsort(records, nrecords, sizeof(record_t), record_cmp);
+	number_epochs(records, nrecords);
+
+	// One worker per traced process, telling apart processes that had the
+	// same id
+	if (pipe(pfd) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	start = now_us();
+	for (i = 0; i < nrecords; i = j) {
+		pid_t p;
+		for (j = i; j < nrecords && records[j].pid == records[i].pid
+			     && records[j].epoch == records[i].epoch; j++)
+			/* do nothing */;
+		p = fork();
+		if (p == -1) {
+			perror("fork");
+			exit(1);
+		} else if (p == 0) {
+			close(pfd[0]);
+			replay_process(&records[i], j - i, first, start, fast, pfd[1]);
+		}
+		nworkers++;
+	}
+	close(pfd[1]);
+
+	memset(stats, 0, sizeof(stats));
+	results = fdopen(pfd[0], "r");
+	while (fgets(line, sizeof(line), results)) {
+		int op, fail;
+		long long latency, bytes;
+		opstats_t *s;
+		if (sscanf(line, "%d %d %lld %lld", &op, &fail, &latency, &bytes) != 4
+		    || op < 0 || op >= NOPS)
+			continue;
+		s = &stats[op];
+		if (s->n == s->size) {
+			s->size = s->size ? s->size * 2 : 256;
+			if (!(s->latency = realloc(s->latency, s->size * sizeof(long long)))) {
+				fprintf(stderr, "osprdreplay: out of memory\n");
+				exit(1);
+			}
+		}
+		s->latency[s->n++] = latency;
+		s->failed += fail;
+		s->bytes += bytes;
+	}
+	fclose(results);
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed++;
+	elapsed = now_us() - start;
+	if (elapsed <= 0)
+		elapsed = 1;
+
+	printf("%-10s %8s %7s %9s %9s %9s\n", "op", "count", "failed",
+	       "p50 ms", "p99 ms", "max ms");
+	for (i = 0; i < NOPS; i++) {
+		opstats_t *s = &stats[i];
+		if (!s->n)
+			continue;
+		qsort(s->latency, s->n, sizeof(long long), latency_cmp);
+		printf("%-10s %8d %7d %9.3f %9.3f %9.3f\n", opnames[i], s->n,
+		       s->failed, quantile(s, 0.50), quantile(s, 0.99),
+		       quantile(s, 1));
+		total_ops += s->n;
+		total_bytes += s->bytes;
+	}
+	printf("%d processes, %lld operations in %.3f s: %.1f ops/s, %.2f MB/s\n",
+	       nworkers, total_ops, elapsed / 1e6, total_ops * 1e6 / elapsed,
+	       (double) total_bytes / elapsed);
+	if (failed) {
+		fprintf(stderr, "osprdreplay: %d workers failed\n", failed);
+		exit(1);
+	}
+	exit(0);
+}